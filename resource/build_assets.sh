@@ -0,0 +1,83 @@
+#!/bin/sh
+# Asset compiler: builds media.mpg from the per-mode clips and writes
+# media.manifest, which game.c loads at startup.
+#
+# Every mode contributes one video and one audio stream, in the order given
+# by $modes. Video is re-encoded with closed GOPs, so each clip can be
+# entered at its first frame without reference to anything before it, and
+# audio is resampled to the output device rate here rather than at runtime.
+
+device_rate=${DEVICE_RATE:-44100}
+gop=${GOP:-12}
+
+game_audio=battle.mp3
+game_image="battle sample.jpg"
+
+attract=hulkfists.mp4
+countdown=countdown.mp4
+game=game.mp4
+winner1=hbwins.mp4
+winner2=hulkwins.mp4
+modes="attract countdown game winner1 winner2"
+
+output=media.mpg
+manifest=media.manifest
+button_sound=button.wav
+
+video_opts="-c:v mpeg2video -mbd rd -trellis 2 -cmp 2 -subcmp 2 -r 25"
+video_opts="$video_opts -g $gop -flags +cgop -sc_threshold 1000000000"
+audio_opts="-c:a mp2 -ar $device_rate -ac 2"
+still_opts="-shortest -vf scale=640:360"
+
+set -e
+
+#ffmpeg -loop 1 -i "$game_image" -i "$game_audio" $still_opts game.mp4
+ffmpeg -y -framerate 1 -pattern_type glob -i 'battle-*.jpg' \
+	       -i $game_audio -r 25 -vf scale=640:360 $game
+
+# Button press feedback, mixed over the stream audio by the player. Kept as
+# PCM at the device rate so that loading it costs nothing.
+[ -f $button_sound ] || ffmpeg -y -f lavfi -i "sine=frequency=880:duration=0.12" \
+	-af "afade=t=out:st=0.06:d=0.06" -ar $device_rate -ac 2 $button_sound
+
+inputs=
+maps=
+n=0
+for mode in $modes; do
+    eval clip=\$$mode
+    inputs="$inputs -i $clip"
+    maps="$maps -map $n:v:0 -map $n:a:0"
+    n=$((n + 1))
+done
+
+ffmpeg -y $inputs $maps $video_opts $audio_opts $output
+
+# Print the start time, duration and byte offset of the first packet of
+# stream $1 of the output.
+probe() {
+    ffprobe -v error -select_streams $1 \
+	    -show_entries packet=pts_time,duration_time,pos -of csv=p=0 \
+	    $output | awk -F, '
+	$1 != "N/A" {
+	    if (!n++) { start = $1; pos = $3 }
+	    if ($1 + $2 > end) end = $1 + $2
+	}
+	END { printf "%.3f %.3f %d\n", start, end - start, pos }'
+}
+
+{
+    echo "# mode video_stream audio_stream start duration entry_pos"
+    n=0
+    for mode in $modes; do
+	video=$((2 * n))
+	audio=$((2 * n + 1))
+	set -- $(probe $video)
+	start=$1
+	duration=$2
+	entry_pos=$3
+	set -- $(probe $audio)
+	[ $3 -lt $entry_pos ] && entry_pos=$3
+	echo "$mode $video $audio $start $duration $entry_pos"
+	n=$((n + 1))
+    done
+} > $manifest
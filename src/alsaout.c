@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/prctl.h>
+
+#include <SDL.h>
+
+#include <libavutil/mem.h>
+
+#include "mclock.h"
+#include "alsaout.h"
+
+#define FRAME_SIZE(o) ((o)->channels * 2)
+
+int alsa_output_open(AlsaOutput *o, const char *device, int channels,
+        int *freq, int period_size, int nb_periods,
+        AlsaFillFunc fill, void *opaque)
+{
+    snd_pcm_hw_params_t *hw;
+    snd_pcm_sw_params_t *sw;
+    snd_pcm_uframes_t period = period_size, buffer;
+    unsigned int rate = *freq, periods = nb_periods;
+    int ret;
+
+    memset(o, 0, sizeof(*o));
+    if ((ret = snd_pcm_open(&o->pcm, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0)
+        return ret;
+
+    snd_pcm_hw_params_alloca(&hw);
+    if ((ret = snd_pcm_hw_params_any(o->pcm, hw)) < 0)
+        goto fail;
+    o->mmap = snd_pcm_hw_params_set_access(o->pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED) >= 0;
+    if ((!o->mmap &&
+         (ret = snd_pcm_hw_params_set_access(o->pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) ||
+        (ret = snd_pcm_hw_params_set_format(o->pcm, hw, SND_PCM_FORMAT_S16)) < 0 ||
+        (ret = snd_pcm_hw_params_set_channels(o->pcm, hw, channels)) < 0 ||
+        (ret = snd_pcm_hw_params_set_rate_near(o->pcm, hw, &rate, NULL)) < 0 ||
+        (ret = snd_pcm_hw_params_set_period_size_near(o->pcm, hw, &period, NULL)) < 0 ||
+        (ret = snd_pcm_hw_params_set_periods_near(o->pcm, hw, &periods, NULL)) < 0 ||
+        (ret = snd_pcm_hw_params(o->pcm, hw)) < 0)
+        goto fail;
+    snd_pcm_hw_params_get_period_size(hw, &period, NULL);
+    snd_pcm_hw_params_get_buffer_size(hw, &buffer);
+
+    /* start once the whole buffer has been filled, wake up per period */
+    snd_pcm_sw_params_alloca(&sw);
+    if ((ret = snd_pcm_sw_params_current(o->pcm, sw)) < 0 ||
+        (ret = snd_pcm_sw_params_set_start_threshold(o->pcm, sw, buffer / period * period)) < 0 ||
+        (ret = snd_pcm_sw_params_set_avail_min(o->pcm, sw, period)) < 0 ||
+        (ret = snd_pcm_sw_params(o->pcm, sw)) < 0)
+        goto fail;
+
+    o->channels    = channels;
+    o->freq        = *freq = rate;
+    o->period_size = period;
+    o->buffer_size = buffer;
+    o->fill        = fill;
+    o->opaque      = opaque;
+    if (!o->mmap && !(o->buf = av_malloc(period * FRAME_SIZE(o)))) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+    return 0;
+fail:
+    snd_pcm_close(o->pcm);
+    o->pcm = NULL;
+    return ret;
+}
+
+static int alsa_recover(AlsaOutput *o, int err)
+{
+    o->xruns++;
+    if ((err = snd_pcm_recover(o->pcm, err, 1)) < 0)
+        fprintf(stderr, "ALSA: %s\n", snd_strerror(err));
+    return err;
+}
+
+/* keep a device that takes everything at once (the null plugin) to real
+   time, one buffer ahead, so that the callback still runs once a period */
+static void alsa_pace(AlsaOutput *o, int frames)
+{
+    if (!o->written)
+        o->start = mclock_read();
+    o->written += frames;
+    if (!o->free_running || o->unpaced || o->written <= o->buffer_size)
+        return;
+    mclock_sleep_until(o->start + (o->written - o->buffer_size) * 1000000LL / o->freq);
+}
+
+static int alsa_output_loop(AlsaOutput *o)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, frames;
+    snd_pcm_sframes_t avail, delay, n;
+    uint8_t *buf;
+    int ret;
+
+    while (!o->abort_request) {
+        if ((avail = snd_pcm_avail_update(o->pcm)) < 0) {
+            if (alsa_recover(o, avail) < 0)
+                return -1;
+            continue;
+        }
+        if (avail < o->period_size) {
+            /* the start threshold only applies to snd_pcm_writei(), a
+               buffer filled through mmap, at first or after a recovery,
+               is started here */
+            if (o->mmap && snd_pcm_state(o->pcm) == SND_PCM_STATE_PREPARED) {
+                if ((ret = snd_pcm_start(o->pcm)) < 0 && alsa_recover(o, ret) < 0)
+                    return -1;
+                continue;
+            }
+            if ((ret = snd_pcm_wait(o->pcm, 100)) < 0 && alsa_recover(o, ret) < 0)
+                return -1;
+            continue;
+        }
+        /* a running device with its whole buffer free is not consuming in
+           real time, a real one would have reported an xrun instead */
+        if (avail >= o->buffer_size && snd_pcm_state(o->pcm) == SND_PCM_STATE_RUNNING)
+            o->free_running = 1;
+
+        /* the period filled now plays once everything queued has */
+        if (snd_pcm_delay(o->pcm, &delay) < 0 || delay < 0)
+            delay = 0;
+        frames = o->period_size;
+        if (o->mmap) {
+            if ((ret = snd_pcm_mmap_begin(o->pcm, &areas, &offset, &frames)) < 0) {
+                if (alsa_recover(o, ret) < 0)
+                    return -1;
+                continue;
+            }
+            buf = (uint8_t *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+            o->fill(o->opaque, buf, frames * FRAME_SIZE(o), delay);
+            n = snd_pcm_mmap_commit(o->pcm, offset, frames);
+        } else {
+            o->fill(o->opaque, o->buf, frames * FRAME_SIZE(o), delay);
+            n = snd_pcm_writei(o->pcm, o->buf, frames);
+        }
+        if (n < 0) {
+            if (alsa_recover(o, n) < 0)
+                return -1;
+            continue;
+        }
+        alsa_pace(o, n);
+    }
+    return 0;
+}
+
+static int alsa_output_thread(void *arg)
+{
+    AlsaOutput *o = arg;
+    struct sched_param param;
+    int ret;
+
+    prctl(PR_SET_NAME, "alsa", 0, 0, 0);
+    if (o->rt_priority > 0) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = o->rt_priority;
+        if ((ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)))
+            fprintf(stderr, "ALSA: no real-time priority for the output thread: %s\n", strerror(ret));
+    }
+
+    /* on virtual time the pacing of a free running device drives the clock
+       along with the display */
+    mclock_virtual_attach();
+    ret = alsa_output_loop(o);
+    mclock_virtual_detach();
+    return ret;
+}
+
+int alsa_output_start(AlsaOutput *o, int rt_priority)
+{
+    o->rt_priority = rt_priority;
+    mclock_virtual_reserve(1);
+    if (!(o->tid = SDL_CreateThread(alsa_output_thread, o))) {
+        mclock_virtual_reserve(-1);
+        return -1;
+    }
+    return 0;
+}
+
+void alsa_output_close(AlsaOutput *o)
+{
+    int attached;
+
+    o->abort_request = 1;
+    if (o->tid) {
+        /* the output thread may be asleep on virtual time */
+        attached = mclock_virtual_detach();
+        SDL_WaitThread(o->tid, NULL);
+        if (attached)
+            mclock_virtual_attach();
+    }
+    if (o->pcm) {
+        snd_pcm_drop(o->pcm);
+        snd_pcm_close(o->pcm);
+    }
+    av_freep(&o->buf);
+    o->pcm = NULL;
+    o->tid = NULL;
+}
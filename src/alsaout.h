@@ -0,0 +1,50 @@
+#ifndef ALSAOUT_H
+#define ALSAOUT_H
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+#include <SDL_thread.h>
+
+/* Direct ALSA playback of interleaved signed 16 bit PCM, for when the
+ * output delay has to be known exactly or kept small. Periods are filled
+ * in place in the mmap area when the device allows it, from a thread at
+ * real-time priority. The driver is asked how many frames are still queued
+ * every time a period is filled. */
+
+/* Fill len bytes for the device. delay is the number of frames queued in
+ * the device ahead of them, as reported by snd_pcm_delay(). */
+typedef void (*AlsaFillFunc)(void *opaque, uint8_t *buf, int len, int delay);
+
+typedef struct AlsaOutput {
+    snd_pcm_t *pcm;
+    SDL_Thread *tid;
+    volatile int abort_request;
+    int channels, freq;
+    int period_size;    /* frames */
+    int buffer_size;    /* frames */
+    int mmap;           /* filling the mmap area, else writing from buf */
+    int rt_priority;    /* SCHED_FIFO priority of the thread, 0 for none */
+    uint8_t *buf;       /* one period, without mmap */
+    AlsaFillFunc fill;
+    void *opaque;
+    int xruns;
+    /* devices that never block (null) are paced to the sample rate, unless
+       unpaced is set to let them take everything as fast as it comes */
+    int free_running;
+    int unpaced;
+    int64_t written;
+    int64_t start;           /* mclock time the first frame was written */
+} AlsaOutput;
+
+/* Open device with about period_size frames per period and nb_periods
+ * periods. *freq is updated to the rate the device settled on. */
+int alsa_output_open(AlsaOutput *o, const char *device, int channels,
+        int *freq, int period_size, int nb_periods,
+        AlsaFillFunc fill, void *opaque);
+
+/* start the thread calling fill(), at rt_priority if it can be had */
+int alsa_output_start(AlsaOutput *o, int rt_priority);
+
+void alsa_output_close(AlsaOutput *o);
+
+#endif
@@ -0,0 +1,209 @@
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <libavutil/common.h>
+
+#include "audioconv.h"
+
+#if defined(__SSE2__)
+/* 8 floats to 8 s16, rounded to nearest, clipped. Out of range floats
+   convert to INT_MIN, so they are clipped before the conversion. */
+static inline __m128i flt_to_s16_sse2(const float *src)
+{
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 min   = _mm_set1_ps(-32768.0f);
+    const __m128 max   = _mm_set1_ps( 32767.0f);
+    __m128 lo = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src),     scale), min), max);
+    __m128 hi = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src + 4), scale), min), max);
+    return _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+}
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+/* The same, rounding as the SSE2 and C paths do, to nearest even. vcvtq
+   truncates, so the rounding is done in float by adding and taking away
+   1.5 * 2^23, which leaves the clipped values no fraction bits. */
+static inline int16x8_t flt_to_s16_neon(const float *src)
+{
+    const float32x4_t magic = vdupq_n_f32(12582912.0f);
+    const float32x4_t min   = vdupq_n_f32(-32768.0f);
+    const float32x4_t max   = vdupq_n_f32( 32767.0f);
+    float32x4_t lo = vminq_f32(vmaxq_f32(vmulq_n_f32(vld1q_f32(src),     32768.0f), min), max);
+    float32x4_t hi = vminq_f32(vmaxq_f32(vmulq_n_f32(vld1q_f32(src + 4), 32768.0f), min), max);
+    lo = vsubq_f32(vaddq_f32(lo, magic), magic);
+    hi = vsubq_f32(vaddq_f32(hi, magic), magic);
+    return vcombine_s16(vmovn_s32(vcvtq_s32_f32(lo)), vmovn_s32(vcvtq_s32_f32(hi)));
+}
+#endif
+
+static inline int16_t flt_to_s16_c(float x)
+{
+    return av_clip_int16(lrintf(x * 32768.0f));
+}
+
+void conv_flt_to_s16(int16_t *dst, const float *src, int nb_samples)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 8 <= nb_samples; i += 8)
+        _mm_storeu_si128((__m128i *)(dst + i), flt_to_s16_sse2(src + i));
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; i + 8 <= nb_samples; i += 8)
+        vst1q_s16(dst + i, flt_to_s16_neon(src + i));
+#endif
+    for (; i < nb_samples; i++)
+        dst[i] = flt_to_s16_c(src[i]);
+}
+
+void conv_mono_to_stereo_s16(int16_t *dst, const int16_t *src, int nb_samples)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 8 <= nb_samples; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i),     _mm_unpacklo_epi16(s, s));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i + 8), _mm_unpackhi_epi16(s, s));
+    }
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; i + 8 <= nb_samples; i += 8) {
+        int16x8x2_t v;
+        v.val[0] = v.val[1] = vld1q_s16(src + i);
+        vst2q_s16(dst + 2 * i, v);
+    }
+#endif
+    for (; i < nb_samples; i++)
+        dst[2 * i] = dst[2 * i + 1] = src[i];
+}
+
+void conv_interleave_s16(int16_t *dst, const int16_t *left, const int16_t *right,
+        int nb_samples)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 8 <= nb_samples; i += 8) {
+        __m128i l = _mm_loadu_si128((const __m128i *)(left  + i));
+        __m128i r = _mm_loadu_si128((const __m128i *)(right + i));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i),     _mm_unpacklo_epi16(l, r));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i + 8), _mm_unpackhi_epi16(l, r));
+    }
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; i + 8 <= nb_samples; i += 8) {
+        int16x8x2_t v;
+        v.val[0] = vld1q_s16(left  + i);
+        v.val[1] = vld1q_s16(right + i);
+        vst2q_s16(dst + 2 * i, v);
+    }
+#endif
+    for (; i < nb_samples; i++) {
+        dst[2 * i]     = left[i];
+        dst[2 * i + 1] = right[i];
+    }
+}
+
+static void convert_s16p(int16_t *dst, const uint8_t * const *src,
+        int nb_samples, int channels)
+{
+    int i, ch;
+
+    if (channels == 1) {
+        memcpy(dst, src[0], nb_samples * sizeof(*dst));
+    } else if (channels == 2) {
+        conv_interleave_s16(dst, (const int16_t *)src[0], (const int16_t *)src[1], nb_samples);
+    } else {
+        for (ch = 0; ch < channels; ch++) {
+            const int16_t *s = (const int16_t *)src[ch];
+            for (i = 0; i < nb_samples; i++)
+                dst[i * channels + ch] = s[i];
+        }
+    }
+}
+
+static void convert_fltp(int16_t *dst, const uint8_t * const *src,
+        int nb_samples, int channels)
+{
+    int i = 0, ch;
+
+    if (channels == 1) {
+        conv_flt_to_s16(dst, (const float *)src[0], nb_samples);
+        return;
+    }
+    if (channels == 2) {
+        const float *l = (const float *)src[0];
+        const float *r = (const float *)src[1];
+        int16_t tl[256], tr[256];
+        int n;
+
+        /* convert a block of each channel, then interleave it while it is
+           still in the cache */
+        for (; i < nb_samples; i += n) {
+            n = FFMIN(nb_samples - i, 256);
+            conv_flt_to_s16(tl, l + i, n);
+            conv_flt_to_s16(tr, r + i, n);
+            conv_interleave_s16(dst + 2 * i, tl, tr, n);
+        }
+        return;
+    }
+    for (ch = 0; ch < channels; ch++) {
+        const float *s = (const float *)src[ch];
+        for (i = 0; i < nb_samples; i++)
+            dst[i * channels + ch] = flt_to_s16_c(s[i]);
+    }
+}
+
+static void convert_flt(int16_t *dst, const uint8_t * const *src,
+        int nb_samples, int channels)
+{
+    conv_flt_to_s16(dst, (const float *)src[0], nb_samples * channels);
+}
+
+static void convert_s16_mono(int16_t *dst, const uint8_t * const *src,
+        int nb_samples, int channels)
+{
+    conv_mono_to_stereo_s16(dst, (const int16_t *)src[0], nb_samples);
+}
+
+static void convert_flt_mono(int16_t *dst, const uint8_t * const *src,
+        int nb_samples, int channels)
+{
+    const float *s = (const float *)src[0];
+    int16_t tmp[256];
+    int i, n;
+
+    for (i = 0; i < nb_samples; i += n) {
+        n = FFMIN(nb_samples - i, 256);
+        conv_flt_to_s16(tmp, s + i, n);
+        conv_mono_to_stereo_s16(dst + 2 * i, tmp, n);
+    }
+}
+
+AudioConvertFunc audio_convert_find(enum AVSampleFormat in_fmt, int in_channels,
+        enum AVSampleFormat out_fmt, int out_channels)
+{
+    if (out_fmt != AV_SAMPLE_FMT_S16)
+        return NULL;
+    if (in_channels == out_channels) {
+        switch (in_fmt) {
+        case AV_SAMPLE_FMT_S16P: return convert_s16p;
+        case AV_SAMPLE_FMT_FLTP: return convert_fltp;
+        case AV_SAMPLE_FMT_FLT:  return convert_flt;
+        default:                 return NULL;
+        }
+    }
+    if (in_channels == 1 && out_channels == 2) {
+        switch (in_fmt) {
+        case AV_SAMPLE_FMT_S16:
+        case AV_SAMPLE_FMT_S16P: return convert_s16_mono;
+        case AV_SAMPLE_FMT_FLT:
+        case AV_SAMPLE_FMT_FLTP: return convert_flt_mono;
+        default:                 return NULL;
+        }
+    }
+    return NULL;
+}
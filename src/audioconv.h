@@ -0,0 +1,29 @@
+#ifndef AUDIOCONV_H
+#define AUDIOCONV_H
+
+#include <stdint.h>
+#include <libavutil/samplefmt.h>
+
+/* Conversion of decoded audio to the interleaved signed 16 bit PCM the
+ * device takes, for the cases that need no resampling: interleaving planar
+ * s16 (what MP2 decodes to), float to s16, and mono to stereo. Floats are
+ * rounded to nearest and clipped. Mono is copied to both channels at full
+ * level. SSE2 or NEON do most of the work where the compiler targets them,
+ * with a C loop for the remainder. */
+
+/* src as in AVFrame.extended_data, nb_samples per channel, channels being
+ * those of the input */
+typedef void (*AudioConvertFunc)(int16_t *dst, const uint8_t * const *src,
+        int nb_samples, int channels);
+
+/* the kernel turning in_fmt with in_channels into interleaved s16 with
+ * out_channels, NULL if there is none and swr has to do it */
+AudioConvertFunc audio_convert_find(enum AVSampleFormat in_fmt, int in_channels,
+        enum AVSampleFormat out_fmt, int out_channels);
+
+void conv_flt_to_s16(int16_t *dst, const float *src, int nb_samples);
+void conv_mono_to_stereo_s16(int16_t *dst, const int16_t *src, int nb_samples);
+void conv_interleave_s16(int16_t *dst, const int16_t *left, const int16_t *right,
+        int nb_samples);
+
+#endif
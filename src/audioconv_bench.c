@@ -0,0 +1,112 @@
+/* Times the audioconv kernels against swr_convert() doing the same
+ * conversion, at the frame sizes the decoders hand out (MP2 1152, AAC 1024,
+ * AC-3 1536, and a large 4096), and checks that both give the same
+ * samples to within one step of rounding.
+ *
+ *     make audioconv_bench && ./audioconv_bench */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <libavutil/channel_layout.h>
+#include <libavutil/mem.h>
+#include <libswresample/swresample.h>
+
+#include "audioconv.h"
+
+#define MAX_SAMPLES 4096
+#define RUNS        2000
+
+static const int frame_sizes[] = { 1024, 1152, 1536, 4096 };
+
+static const struct {
+    const char *name;
+    enum AVSampleFormat fmt;
+    int channels, out_channels;
+} cases[] = {
+    { "s16p stereo -> s16",       AV_SAMPLE_FMT_S16P, 2, 2 },
+    { "fltp stereo -> s16",       AV_SAMPLE_FMT_FLTP, 2, 2 },
+    { "flt stereo -> s16",        AV_SAMPLE_FMT_FLT,  2, 2 },
+    { "s16 mono -> s16 stereo",   AV_SAMPLE_FMT_S16,  1, 2 },
+    { "fltp mono -> s16 stereo",  AV_SAMPLE_FMT_FLTP, 1, 2 },
+};
+
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void fill(uint8_t **planes, enum AVSampleFormat fmt, int channels, int nb_samples)
+{
+    int nb_planes = av_sample_fmt_is_planar(fmt) ? channels : 1;
+    int per_plane = av_sample_fmt_is_planar(fmt) ? nb_samples : nb_samples * channels;
+    int p, i;
+
+    for (p = 0; p < nb_planes; p++) {
+        for (i = 0; i < per_plane; i++) {
+            if (av_get_packed_sample_fmt(fmt) == AV_SAMPLE_FMT_FLT)
+                ((float *)planes[p])[i] = (rand() / (float)RAND_MAX) * 2.2f - 1.1f;
+            else
+                ((int16_t *)planes[p])[i] = rand();
+        }
+    }
+}
+
+int main(void)
+{
+    uint8_t *in[2];
+    int16_t *out_conv, *out_swr;
+    int c, f, i, run, diff;
+
+    in[0]    = av_malloc(MAX_SAMPLES * 2 * sizeof(float));
+    in[1]    = av_malloc(MAX_SAMPLES * sizeof(float));
+    out_conv = av_malloc(MAX_SAMPLES * 2 * sizeof(int16_t));
+    out_swr  = av_malloc(MAX_SAMPLES * 2 * sizeof(int16_t) + 1024);
+
+    printf("%-26s %6s %12s %12s %8s\n", "conversion", "frame", "kernel ns", "swr ns", "maxdiff");
+    for (c = 0; c < FF_ARRAY_ELEMS(cases); c++) {
+        AudioConvertFunc convert = audio_convert_find(cases[c].fmt, cases[c].channels,
+                                                      AV_SAMPLE_FMT_S16, cases[c].out_channels);
+        struct SwrContext *swr = swr_alloc_set_opts(NULL,
+                av_get_default_channel_layout(cases[c].out_channels), AV_SAMPLE_FMT_S16, 48000,
+                av_get_default_channel_layout(cases[c].channels), cases[c].fmt, 48000, 0, NULL);
+
+        /* match the kernels, which copy mono at full level */
+        if (cases[c].channels == 1) {
+            double matrix[2] = { 1.0, 1.0 };
+            swr_set_matrix(swr, matrix, 1);
+        }
+        if (!convert || !swr || swr_init(swr) < 0) {
+            fprintf(stderr, "%s: cannot set up\n", cases[c].name);
+            return 1;
+        }
+        for (f = 0; f < FF_ARRAY_ELEMS(frame_sizes); f++) {
+            int n = frame_sizes[f];
+            double t0, t1, t2;
+
+            fill(in, cases[c].fmt, cases[c].channels, n);
+            t0 = now();
+            for (run = 0; run < RUNS; run++)
+                convert(out_conv, (const uint8_t * const *)in, n, cases[c].channels);
+            t1 = now();
+            for (run = 0; run < RUNS; run++)
+                swr_convert(swr, (uint8_t **)&out_swr, MAX_SAMPLES + 256, (const uint8_t **)in, n);
+            t2 = now();
+
+            for (i = diff = 0; i < n * cases[c].out_channels; i++)
+                diff = FFMAX(diff, abs(out_conv[i] - out_swr[i]));
+            printf("%-26s %6d %12.0f %12.0f %8d\n", cases[c].name, n,
+                   (t1 - t0) * 1e9 / RUNS, (t2 - t1) * 1e9 / RUNS, diff);
+        }
+        swr_free(&swr);
+    }
+    av_free(in[0]);
+    av_free(in[1]);
+    av_free(out_conv);
+    av_free(out_swr);
+    return 0;
+}
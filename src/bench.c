@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/resource.h>
+
+#include <SDL.h>
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avfft.h>
+#include <libavutil/avstring.h>
+
+#include "mixer.h"
+#include "alsaout.h"
+#include "pktarena.h"
+#include "ffplay.h"
+#include "mclock.h"
+#include "bench.h"
+
+#define BENCH_THREADS 64
+
+typedef struct ThreadTime {
+    int tid;
+    char name[16];
+    int64_t ticks;          /* user + system */
+} ThreadTime;
+
+typedef struct BenchSample {
+    int64_t time;
+    int frames;             /* pictures converted for display */
+    int frames_decoded;
+    int64_t stage_time[STAGE_NB];
+    ThreadTime threads[BENCH_THREADS];
+    int nb_threads;
+} BenchSample;
+
+static const char *const stage_names[STAGE_NB] = {
+    [STAGE_READ]         = "read",
+    [STAGE_VIDEO_DECODE] = "video_decode",
+    [STAGE_AUDIO_DECODE] = "audio_decode",
+    [STAGE_CONVERT]      = "convert",
+    [STAGE_COMPOSITE]    = "composite",
+    [STAGE_DISPLAY]      = "display",
+};
+
+static struct {
+    const BenchClip *clips;
+    int nb_clips, cur;
+    void (*start)(int id);
+    BenchSample first;
+    FILE *out;
+} bench;
+
+/* CPU time of every thread of the process so far, from /proc */
+static int read_threads(ThreadTime *t, int max)
+{
+    DIR *dir = opendir("/proc/self/task");
+    struct dirent *e;
+    char path[64], buf[512], *name, *end;
+    unsigned long utime, stime;
+    FILE *f;
+    int n = 0;
+
+    if (!dir)
+        return 0;
+    while (n < max && (e = readdir(dir))) {
+        if (e->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "/proc/self/task/%s/stat", e->d_name);
+        if (!(f = fopen(path, "r")))
+            continue;
+        /* "tid (name) state ppid pgrp session tty tpgid flags minflt
+           cminflt majflt cmajflt utime stime ..." */
+        if (fgets(buf, sizeof(buf), f) && (name = strchr(buf, '(')) &&
+            (end = strrchr(buf, ')')) &&
+            sscanf(end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                   &utime, &stime) == 2) {
+            name++;
+            t[n].tid = atoi(e->d_name);
+            av_strlcpy(t[n].name, name, FFMIN(sizeof(t[n].name), end - name + 1));
+            t[n].ticks = utime + stime;
+            n++;
+        }
+        fclose(f);
+    }
+    closedir(dir);
+    return n;
+}
+
+/* s as a quoted JSON string: names come from the command line, the
+   manifest and the kernel, any of which may hold quotes or control bytes */
+static void json_string(FILE *f, const char *s)
+{
+    unsigned char c;
+
+    fputc('"', f);
+    while ((c = *s++)) {
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void sample(VideoState *is, BenchSample *s)
+{
+    s->time           = mclock_read();
+    s->frames         = is->conversions;
+    s->frames_decoded = is->frames_decoded;
+    memcpy(s->stage_time, is->stage_time, sizeof(s->stage_time));
+    s->nb_threads     = read_threads(s->threads, BENCH_THREADS);
+}
+
+static void report(const BenchClip *clip, const BenchSample *a, const BenchSample *b)
+{
+    double seconds = (b->time - a->time) / 1000000.0;
+    double ms_per_tick = 1000.0 / sysconf(_SC_CLK_TCK);
+    int i, j;
+
+    fprintf(bench.out, "%s\n    {\"clip\": ", bench.cur ? "," : "");
+    json_string(bench.out, clip->name);
+    fprintf(bench.out, ", \"seconds\": %.3f, \"frames\": %d, \"frames_decoded\": %d, \"fps\": %.2f,\n",
+            seconds,
+            b->frames - a->frames, b->frames_decoded - a->frames_decoded,
+            seconds > 0 ? (b->frames - a->frames) / seconds : 0);
+
+    fprintf(bench.out, "     \"stage_ms\": {");
+    for (i = 0; i < STAGE_NB; i++)
+        fprintf(bench.out, "%s\"%s\": %.1f", i ? ", " : "", stage_names[i],
+                (b->stage_time[i] - a->stage_time[i]) / 1000.0);
+    fprintf(bench.out, "},\n");
+
+    /* threads started during the clip count from zero, those gone by its
+       end are lost */
+    fprintf(bench.out, "     \"threads\": [");
+    for (i = 0; i < b->nb_threads; i++) {
+        int64_t ticks = b->threads[i].ticks;
+        for (j = 0; j < a->nb_threads; j++)
+            if (a->threads[j].tid == b->threads[i].tid)
+                ticks -= a->threads[j].ticks;
+        fprintf(bench.out, "%s{\"tid\": %d, \"name\": ", i ? ", " : "", b->threads[i].tid);
+        json_string(bench.out, b->threads[i].name);
+        fprintf(bench.out, ", \"cpu_ms\": %.0f}", ticks * ms_per_tick);
+    }
+    fprintf(bench.out, "]}");
+}
+
+static void clip_start(VideoState *is, void *opaque);
+static void clip_end(VideoState *is, void *opaque);
+
+static void clip_timers(VideoState *is, int segment)
+{
+    media_timer_add(is, segment, MEDIA_TIMER_START, clip_start, NULL);
+    media_timer_add(is, segment, MEDIA_TIMER_EOS, clip_end, NULL);
+}
+
+static void clip_start(VideoState *is, void *opaque)
+{
+    sample(is, &bench.first);
+    if (bench.start)
+        bench.start(bench.clips[bench.cur].id);
+}
+
+static void clip_end(VideoState *is, void *opaque)
+{
+    const BenchClip *next;
+    BenchSample last;
+    struct rusage ru;
+
+    sample(is, &last);
+    report(&bench.clips[bench.cur], &bench.first, &last);
+
+    if (++bench.cur < bench.nb_clips) {
+        next = &bench.clips[bench.cur];
+        clip_timers(is, stream_switch(is, next->video_stream, next->audio_stream,
+                                      next->entry_pos, 0));
+        return;
+    }
+
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(bench.out, "\n  ],\n  \"peak_rss_kb\": %ld\n}\n", ru.ru_maxrss);
+    fclose(bench.out);
+    do_exit(is);
+}
+
+void benchmark_run(const char *filename, const BenchClip *clips, int nb_clips,
+        void (*start)(int id))
+{
+    VideoState *is;
+    int fd;
+
+    bench.clips    = clips;
+    bench.nb_clips = nb_clips;
+    bench.start    = start;
+
+    /* the report has stdout to itself */
+    fflush(stdout);
+    fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    if (fd < 0 || !(bench.out = fdopen(fd, "w"))) {
+        fprintf(stderr, "Cannot set up the benchmark output\n");
+        exit(1);
+    }
+
+    setenv("SDL_VIDEODRIVER", "dummy", 1);
+    setenv("SDL_AUDIODRIVER", "dummy", 1);
+    audio_device   = "null";
+    benchmark_mode = 1;
+    loop_clip      = 0;
+    wanted_stream[AVMEDIA_TYPE_VIDEO] = clips[0].video_stream;
+    wanted_stream[AVMEDIA_TYPE_AUDIO] = clips[0].audio_stream;
+
+    fprintf(bench.out, "{\n  \"file\": ");
+    json_string(bench.out, filename);
+    fprintf(bench.out, ",\n  \"clips\": [");
+    is = ffplay_init(filename);
+    clip_timers(is, 0);
+    ffplay_event_loop(is);
+}
@@ -0,0 +1,25 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+/* Headless throughput benchmark. Clips are played one after the other on
+ * the SDL dummy video driver into the ALSA null device, every picture being
+ * shown as soon as it is decoded, so the read, decode, convert and
+ * composite path runs as fast as it can. The JSON report has stdout to
+ * itself, the player's own messages are moved to stderr. */
+
+typedef struct BenchClip {
+    const char *name;
+    int id;                 /* handed to the start callback */
+    int video_stream;
+    int audio_stream;
+    int64_t entry_pos;      /* byte offset of the first packet, -1 if unknown */
+} BenchClip;
+
+/* Run the clips in order and exit. start, if set, is called from the event
+ * loop as each clip reaches the screen. */
+void benchmark_run(const char *filename, const BenchClip *clips, int nb_clips,
+        void (*start)(int id));
+
+#endif
@@ -0,0 +1,69 @@
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "blend.h"
+
+void blend_row(uint8_t *dst, const uint8_t *src, int width, int alpha)
+{
+    int i = 0;
+
+    if (alpha <= 0)
+        return;
+    if (alpha >= 256) {
+        memcpy(dst, src, width);
+        return;
+    }
+#if defined(__SSE2__)
+    {
+        __m128i a    = _mm_set1_epi16(alpha);
+        __m128i ia   = _mm_set1_epi16(256 - alpha);
+        __m128i zero = _mm_setzero_si128();
+
+        /* 255 * 256 still fits the unsigned 16 bit lanes */
+        for (; i + 16 <= width; i += 16) {
+            __m128i s  = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i d  = _mm_loadu_si128((const __m128i *)(dst + i));
+            __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), a),
+                                       _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), ia));
+            __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), a),
+                                       _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), ia));
+            _mm_storeu_si128((__m128i *)(dst + i),
+                             _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+        }
+    }
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    {
+        /* 1 <= alpha <= 255 here, so both weights fit a byte */
+        uint8x8_t a  = vdup_n_u8(alpha);
+        uint8x8_t ia = vdup_n_u8(256 - alpha);
+
+        for (; i + 16 <= width; i += 16) {
+            uint8x16_t s = vld1q_u8(src + i);
+            uint8x16_t d = vld1q_u8(dst + i);
+            uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(s), a), vget_low_u8(d), ia);
+            uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(s), a), vget_high_u8(d), ia);
+            vst1q_u8(dst + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+        }
+    }
+#endif
+    for (; i < width; i++)
+        dst[i] = (src[i] * alpha + dst[i] * (256 - alpha)) >> 8;
+}
+
+void blend_plane(uint8_t *dst, int dst_linesize,
+        const uint8_t *src, int src_linesize,
+        int width, int height, int alpha)
+{
+    int y;
+
+    for (y = 0; y < height; y++) {
+        blend_row(dst, src, width, alpha);
+        dst += dst_linesize;
+        src += src_linesize;
+    }
+}
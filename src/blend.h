@@ -0,0 +1,20 @@
+#ifndef BLEND_H
+#define BLEND_H
+
+#include <stdint.h>
+
+/* Alpha blending of 8 bit planes, for compositing one YUV 4:2:0 picture
+ * over another. alpha runs from 0 (dst unchanged) to 256 (src copied):
+ *
+ *     dst = (src * alpha + dst * (256 - alpha)) >> 8
+ *
+ * The rows are done 16 pixels at a time with SSE2 or NEON where the
+ * compiler targets them, with a C loop for the remainder. */
+
+void blend_row(uint8_t *dst, const uint8_t *src, int width, int alpha);
+
+void blend_plane(uint8_t *dst, int dst_linesize,
+        const uint8_t *src, int src_linesize,
+        int width, int height, int alpha);
+
+#endif
@@ -537,6 +537,9 @@ typedef struct FrameBuffer {
  * Get a frame from the pool. This is intended to be used as a callback for
  * AVCodecContext.get_buffer.
  *
+ * Only one thread may take buffers from a pool at a time; they may be
+ * released from any thread.
+ *
  * @param s codec context. s->opaque must be a pointer to the head of the
  *          buffer pool.
  * @param frame frame->opaque will be set to point to the FrameBuffer
@@ -544,6 +547,18 @@ typedef struct FrameBuffer {
  */
 int codec_get_buffer(AVCodecContext *s, AVFrame *frame);
 
+/**
+ * Take another reference to a buffer from codec_get_buffer(), keeping its
+ * data valid after the decoder has released it.
+ */
+void frame_buffer_ref(FrameBuffer *buf);
+
+/**
+ * Drop a reference to a buffer. The buffer goes back to its pool once the
+ * last one is gone.
+ */
+void frame_buffer_unref(FrameBuffer *buf);
+
 /**
  * A callback to be used for AVCodecContext.release_buffer along with
  * codec_get_buffer().
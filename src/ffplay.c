@@ -30,6 +30,11 @@
 #include <math.h>
 #include <limits.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <libavutil/avstring.h>
 #include "colorspace.h"
 #include <libavutil/mathematics.h>
@@ -50,15 +55,28 @@
 #include <SDL.h>
 #include <SDL_thread.h>
 
+#include "mixer.h"
+#include "alsaout.h"
+#include "audioconv.h"
+#include "pktarena.h"
 #include "ffplay.h"
 #include "cmdutils.h"
+#include "packmap.h"
+#include "prefetch.h"
+#include "mclock.h"
+#include "present.h"
+#include "blend.h"
 
 #include <assert.h>
 
 const char program_name[] = "ffplay";
 const int program_birth_year = 2003;
 
+/* the reader stops once every queue holds its target duration (or, when
+   durations are unknown, MIN_FRAMES packets) and resumes below half of it.
+   The byte limits only bound memory against broken timestamps. */
 #define MAX_QUEUE_SIZE (15 * 1024 * 1024)
+#define LOW_QUEUE_SIZE (MAX_QUEUE_SIZE * 3 / 4)
 #define MIN_FRAMES 5
 
 /* no AV sync correction is done if below the AV sync threshold */
@@ -66,6 +84,19 @@ const int program_birth_year = 2003;
 /* no AV correction is done if too big error */
 #define AV_NOSYNC_THRESHOLD 10.0
 
+/* video clock PLL: share of the error corrected per frame, share of the
+   accumulated error, and the most a frame delay is stretched or shortened */
+#define VIDEO_PLL_KP        0.1
+#define VIDEO_PLL_KI        0.005
+#define VIDEO_PLL_MAX_ADJUST 0.1
+/* locked once the error stays inside the window for that many frames, lost
+   past the unlock threshold; past the capture range frames are skipped or
+   repeated as without the PLL */
+#define VIDEO_PLL_LOCK_WINDOW   0.01
+#define VIDEO_PLL_LOCK_FRAMES   25
+#define VIDEO_PLL_UNLOCK        0.04
+#define VIDEO_PLL_CAPTURE       0.25
+
 /* maximum audio speed change to get correct sync */
 #define SAMPLE_CORRECTION_PERCENT_MAX 10
 
@@ -77,8 +108,8 @@ const int program_birth_year = 2003;
 /* we use about AUDIO_DIFF_AVG_NB A-V differences to make the average */
 #define AUDIO_DIFF_AVG_NB   20
 
-/* polls for possible required screen refresh at least this often, should be less than 1/fps */
-#define REFRESH_RATE 0.01
+/* input is polled this often when no picture is due sooner */
+#define EVENT_POLL_INTERVAL 0.02
 
 #define CURSOR_HIDE_DELAY 1000000
 
@@ -90,6 +121,12 @@ enum {
     AV_SYNC_EXTERNAL_CLOCK, /* synchronize to an external clock */
 };
 
+/* how a video slaved to another clock follows it */
+enum {
+    VIDEO_SYNC_STEP,        /* skip or repeat whole frame delays, default */
+    VIDEO_SYNC_PLL,         /* stretch frame delays in proportion to the error */
+};
+
 /* options specified by the user */
 AVInputFormat *file_iformat;
 const char *input_filename;
@@ -110,8 +147,11 @@ int wanted_stream[AVMEDIA_TYPE_NB] = {
 };
 static int seek_by_bytes = -1;
 int display_disable;
+int benchmark_mode;     /* pictures shown as soon as they are decoded, stages timed */
+int simulation_mode;    /* on virtual time, held until the decoders catch up */
 static int show_status = 0;
 static int av_sync_type = AV_SYNC_AUDIO_MASTER;
+static int video_sync_mode = VIDEO_SYNC_STEP;
 static int64_t start_time = AV_NOPTS_VALUE;
 static int64_t duration = AV_NOPTS_VALUE;
 static int workaround_bugs = 1;
@@ -128,8 +168,32 @@ static int autoexit;
 static int exit_on_keydown;
 static int exit_on_mousedown;
 static int loop = 1;
+int loop_clip = 0;
+int64_t loop_cache_budget = 32 * 1024 * 1024;
 static int framedrop = -1;
+static double display_refresh_rate = 0;  /* Hz, 0 to take it from the framebuffer mode */
+int display_vsync;      /* presents wait for the vertical blank, whatever the mode flags say */
+static PresentClock present_clock;
+static int quality_governor = 1;    /* trade decoding quality for time when frames run late */
 static int infinite_buffer = -1;
+static int pack_skip = 1;
+int layer_enable = 0;
+int thread_budget = 0;          /* decoder threads for all video, 0 for one per core */
+double crossfade_duration = 0.5;
+static int audio_ring_ms = 100;  /* decoded audio kept ahead of the device */
+int video_queue_ms = 1000;   /* compressed read-ahead per stream */
+int audio_queue_ms = 1000;
+int io_prefetch_kb = 4096;  /* read-ahead of local files, 0 to let avio read them */
+int io_block_kb = 256;
+int audio_buffer_size = SDL_AUDIO_BUFFER_SIZE;  /* samples per device period */
+const char *audio_device = NULL;    /* ALSA device to drive directly, NULL for SDL audio */
+int audio_periods = 2;              /* periods in the ALSA buffer */
+int audio_rt_priority = 50;         /* SCHED_FIFO priority of the ALSA thread, 0 for none */
+int64_t audio_cache_max = 8 * 1024 * 1024;  /* PCM per cached stream */
+static int audio_cache_streams[AUDIO_CACHE_NB];
+static int nb_audio_cache_streams;
+static const char *audio_effect_files[AUDIO_EFFECT_NB];
+static int nb_audio_effects;
 static enum ShowMode show_mode = SHOW_MODE_NONE;
 static const char *audio_codec_name;
 static const char *subtitle_codec_name;
@@ -150,19 +214,50 @@ AVPacket flush_pkt;
 SDL_Surface *screen;
 
 static int packet_queue_put(PacketQueue *q, AVPacket *pkt);
+static void loop_cache_reset(VideoState *is);
+static void media_timers_update(VideoState *is, double pts, int at_end);
+static int audio_cache_find(VideoState *is, AVPacket *pkt, int index, uint8_t **buf);
+static void picture_release(VideoPicture *vp);
+static void pictq_convert_ahead(VideoState *is, VideoPicture *vp);
+static void pictq_convert_wait(VideoState *is, VideoPicture *vp, int convert);
+static void reclaim_item_clear(ReclaimItem *item);
+static void reclaim(Reclaimer *r, ReclaimItem *item);
+
+/* names the calling thread, for top -H and the benchmark report */
+static void thread_name(const char *name)
+{
+    prctl(PR_SET_NAME, name, 0, 0, 0);
+}
+
+static int64_t stage_begin(void)
+{
+    return benchmark_mode ? mclock_read() : 0;
+}
+
+static void stage_end(VideoState *is, int stage, int64_t start)
+{
+    if (benchmark_mode)
+        __sync_fetch_and_add(&is->stage_time[stage], mclock_read() - start);
+}
 
-static int packet_queue_put_private(PacketQueue *q, AVPacket *pkt)
+#define PACKET_SLAB_SIZE (16 * 1024)
+
+/* the node comes from the queue's arena, the payload is taken over from pkt */
+static int packet_queue_put_private(PacketQueue *q, AVPacket *pkt, int64_t duration)
 {
     MyAVPacketList *pkt1;
+    PacketSlab *slab;
 
     if (q->abort_request)
        return -1;
 
-    pkt1 = av_malloc(sizeof(MyAVPacketList));
+    pkt1 = pkt_arena_alloc(&q->arena, sizeof(*pkt1), &slab);
     if (!pkt1)
         return -1;
     pkt1->pkt = *pkt;
+    pkt1->slab = slab;
     pkt1->next = NULL;
+    pkt1->duration = duration;
     if (pkt == &flush_pkt)
         q->serial++;
     pkt1->serial = q->serial;
@@ -174,21 +269,23 @@ static int packet_queue_put_private(PacketQueue *q, AVPacket *pkt)
     q->last_pkt = pkt1;
     q->nb_packets++;
     q->size += pkt1->pkt.size + sizeof(*pkt1);
+    q->duration += duration;
     /* XXX: should duplicate packet data in DV case */
     SDL_CondSignal(q->cond);
     return 0;
 }
 
-static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
+/* duration is what pkt adds to the read-ahead, 0 if unknown */
+static int packet_queue_put_timed(PacketQueue *q, AVPacket *pkt, int64_t duration)
 {
     int ret;
 
-    /* duplicate the packet */
+    /* a payload the demuxer still owns has to be made the packet's own */
     if (pkt != &flush_pkt && av_dup_packet(pkt) < 0)
         return -1;
 
     SDL_LockMutex(q->mutex);
-    ret = packet_queue_put_private(q, pkt);
+    ret = packet_queue_put_private(q, pkt, duration);
     SDL_UnlockMutex(q->mutex);
 
     if (pkt != &flush_pkt && ret < 0)
@@ -197,6 +294,42 @@ static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
     return ret;
 }
 
+static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
+{
+    return packet_queue_put_timed(q, pkt, 0);
+}
+
+static void wakeup_init(Wakeup *w)
+{
+    w->pending = 0;
+    w->waiting = 0;
+}
+
+/* Both sides set their own flag before reading the other's, so either the
+   sender sees the waiter or the waiter sees the wakeup. Only a sleeping
+   waiter costs the sender a system call. */
+static void wakeup_signal(Wakeup *w)
+{
+    if (!__sync_fetch_and_or(&w->pending, 1) && w->waiting)
+        syscall(SYS_futex, &w->pending, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* sleep until the next wakeup_signal(), or at most timeout ms if > 0. The
+   caller looks again at whatever it waits for, so an early return is
+   harmless. */
+static void wakeup_wait(Wakeup *w, int timeout)
+{
+    struct timespec ts = { timeout / 1000, timeout % 1000 * 1000000 };
+
+    __sync_fetch_and_add(&w->waiting, 1);
+    if (!w->pending)
+        syscall(SYS_futex, &w->pending, FUTEX_WAIT_PRIVATE, 0, timeout > 0 ? &ts : NULL, NULL, 0);
+    __sync_fetch_and_sub(&w->waiting, 1);
+    /* a full barrier, so that the caller's next look at what it waits for
+       comes after the clear and a wakeup sent in between is not missed */
+    __sync_fetch_and_and(&w->pending, 0);
+}
+
 /* packet queue handling */
 static void packet_queue_init(PacketQueue *q)
 {
@@ -204,28 +337,37 @@ static void packet_queue_init(PacketQueue *q)
     q->mutex = SDL_CreateMutex();
     q->cond = SDL_CreateCond();
     q->abort_request = 1;
+    pkt_arena_init(&q->arena, PACKET_SLAB_SIZE);
 }
 
+/* Only the chain is detached under the lock. Its packets are freed after,
+   on the reclaimer if there is one, along with the slabs of their nodes. */
 static void packet_queue_flush(PacketQueue *q)
 {
-    MyAVPacketList *pkt, *pkt1;
+    ReclaimItem item = { 0 };
 
     SDL_LockMutex(q->mutex);
-    for (pkt = q->first_pkt; pkt != NULL; pkt = pkt1) {
-        pkt1 = pkt->next;
-        av_free_packet(&pkt->pkt);
-        av_freep(&pkt);
-    }
+    item.pkts  = q->first_pkt;
+    item.slabs = pkt_arena_detach(&q->arena);
     q->last_pkt = NULL;
     q->first_pkt = NULL;
     q->nb_packets = 0;
     q->size = 0;
+    q->duration = 0;
     SDL_UnlockMutex(q->mutex);
+
+    if (!item.pkts && !item.slabs)
+        return;
+    if (q->reclaim)
+        reclaim(q->reclaim, &item);
+    else
+        reclaim_item_clear(&item);
 }
 
 static void packet_queue_destroy(PacketQueue *q)
 {
     packet_queue_flush(q);
+    pkt_arena_free(&q->arena);
     SDL_DestroyMutex(q->mutex);
     SDL_DestroyCond(q->cond);
 }
@@ -245,7 +387,9 @@ static void packet_queue_start(PacketQueue *q)
 {
     SDL_LockMutex(q->mutex);
     q->abort_request = 0;
-    packet_queue_put_private(q, &flush_pkt);
+    packet_queue_put_private(q, &flush_pkt, 0);
+    if (q->reader)
+        wakeup_signal(q->reader);
     SDL_UnlockMutex(q->mutex);
 }
 
@@ -270,16 +414,29 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block, int *seria
                 q->last_pkt = NULL;
             q->nb_packets--;
             q->size -= pkt1->pkt.size + sizeof(*pkt1);
+            q->drained += pkt1->pkt.size + sizeof(*pkt1);
+            q->duration -= pkt1->duration;
+            /* wake the reader as this queue drops to half its target or
+               empties, or once enough has gone for the total to have
+               dropped below its low mark */
+            if (q->reader && ((q->duration <= q->target / 2 && q->duration + pkt1->duration > q->target / 2) ||
+                              q->nb_packets == MIN_FRAMES / 2 || !q->nb_packets ||
+                              q->drained >= MAX_QUEUE_SIZE - LOW_QUEUE_SIZE)) {
+                q->drained = 0;
+                wakeup_signal(q->reader);
+            }
             *pkt = pkt1->pkt;
             if (serial)
                 *serial = pkt1->serial;
-            av_free(pkt1);
+            pkt_arena_release(&q->arena, q->first_pkt ? q->first_pkt->slab : q->arena.last);
             ret = 1;
             break;
         } else if (!block) {
             ret = 0;
             break;
         } else {
+            /* a decoder run dry may be what virtual time waits for */
+            mclock_virtual_kick();
             SDL_CondWait(q->cond, q->mutex);
         }
     }
@@ -287,6 +444,146 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block, int *seria
     return ret;
 }
 
+/* deferred frees, so that the display, decoder and switching threads do not
+   stall on the allocator when they let go of a lot at once */
+static void reclaim_item_clear(ReclaimItem *item)
+{
+    MyAVPacketList *pkt, *pkt1;
+
+    for (pkt = item->pkts; pkt != NULL; pkt = pkt1) {
+        pkt1 = pkt->next;
+        av_free_packet(&pkt->pkt);
+        if (!item->slabs)
+            av_free(pkt);
+    }
+    pkt_arena_free_slabs(item->slabs);
+    avsubtitle_free(&item->sub);
+    avcodec_free_frame(&item->frame);
+    av_free(item->buf);
+}
+
+static int reclaim_thread(void *arg)
+{
+    Reclaimer *r = arg;
+    ReclaimItem *item, *next;
+    int quit;
+
+    thread_name("reclaim");
+    /* the nice value is per thread on Linux */
+    setpriority(PRIO_PROCESS, 0, 19);
+    do {
+        SDL_LockMutex(r->mutex);
+        while (!r->first && !r->abort_request)
+            SDL_CondWait(r->cond, r->mutex);
+        item = r->first;
+        r->first = r->last = NULL;
+        quit = r->abort_request;
+        SDL_UnlockMutex(r->mutex);
+
+        for (; item; item = next) {
+            next = item->next;
+            reclaim_item_clear(item);
+            av_free(item);
+        }
+    } while (!quit);
+    return 0;
+}
+
+static void reclaimer_start(Reclaimer *r)
+{
+    r->mutex = SDL_CreateMutex();
+    r->cond  = SDL_CreateCond();
+    r->tid   = SDL_CreateThread(reclaim_thread, r);
+    r->abort_request = !r->tid;
+}
+
+/* what is still pending is freed before this returns */
+static void reclaimer_stop(Reclaimer *r)
+{
+    SDL_LockMutex(r->mutex);
+    r->abort_request = 1;
+    SDL_CondSignal(r->cond);
+    SDL_UnlockMutex(r->mutex);
+    if (r->tid)
+        SDL_WaitThread(r->tid, NULL);
+    r->tid = NULL;
+    SDL_DestroyMutex(r->mutex);
+    SDL_DestroyCond(r->cond);
+}
+
+/* take over what item points to, freeing it here if the thread is gone */
+static void reclaim(Reclaimer *r, ReclaimItem *item)
+{
+    ReclaimItem *item1 = av_malloc(sizeof(*item1));
+    int queued = 0;
+
+    if (item1) {
+        *item1 = *item;
+        item1->next = NULL;
+        SDL_LockMutex(r->mutex);
+        if (!r->abort_request) {
+            if (!r->last)
+                r->first = item1;
+            else
+                r->last->next = item1;
+            r->last = item1;
+            SDL_CondSignal(r->cond);
+            queued = 1;
+        }
+        SDL_UnlockMutex(r->mutex);
+    }
+    if (!queued) {
+        reclaim_item_clear(item);
+        av_free(item1);
+    }
+}
+
+static void reclaim_packets(Reclaimer *r, MyAVPacketList *pkts)
+{
+    ReclaimItem item = { 0 };
+
+    if (!pkts)
+        return;
+    item.pkts = pkts;
+    reclaim(r, &item);
+}
+
+/* sub is left empty */
+static void reclaim_subtitle(Reclaimer *r, AVSubtitle *sub)
+{
+    ReclaimItem item = { 0 };
+
+    if (!sub->num_rects)
+        return;
+    item.sub = *sub;
+    memset(sub, 0, sizeof(*sub));
+    reclaim(r, &item);
+}
+
+static void reclaim_frame(Reclaimer *r, AVFrame **frame)
+{
+    ReclaimItem item = { 0 };
+
+    if (!*frame)
+        return;
+    item.frame = *frame;
+    *frame = NULL;
+    reclaim(r, &item);
+}
+
+/* like av_freep() */
+static void reclaim_buffer(Reclaimer *r, void *arg)
+{
+    ReclaimItem item = { 0 };
+    void **buf = arg;
+
+    if (!*buf)
+        return;
+    item.buf = *buf;
+    *buf = NULL;
+    reclaim(r, &item);
+}
+
 static inline void fill_rectangle(SDL_Surface *screen,
                                   int x, int y, int w, int h, int color, int update)
 {
@@ -565,9 +862,9 @@ static void blend_subrect(AVPicture *dst, const AVSubtitleRect *rect, int imgw,
     }
 }
 
-static void free_subpicture(SubPicture *sp)
+static void free_subpicture(VideoState *is, SubPicture *sp)
 {
-    avsubtitle_free(&sp->sub);
+    reclaim_subtitle(&is->reclaim, &sp->sub);
 }
 
 static void calculate_display_rect(SDL_Rect *rect, int scr_xleft, int scr_ytop, int scr_width, int scr_height, VideoPicture *vp)
@@ -609,10 +906,12 @@ static void video_image_display(VideoState *is)
     SubPicture *sp;
     AVPicture pict;
     SDL_Rect rect;
+    int64_t start;
     int i;
 
     vp = &is->pictq[is->pictq_rindex];
     if (vp->bmp) {
+        pictq_convert_wait(is, vp, 1);
         if (is->subtitle_st) {
             if (is->subpq_size > 0) {
                 sp = &is->subpq[is->subpq_rindex];
@@ -636,10 +935,14 @@ static void video_image_display(VideoState *is)
                 }
             }
         }
+        start = stage_begin();
 	frame_modify_hook(vp->bmp);
+        stage_end(is, STAGE_COMPOSITE, start);
 
         calculate_display_rect(&rect, is->xleft, is->ytop, is->width, is->height, vp);
+        start = stage_begin();
         SDL_DisplayYUVOverlay(vp->bmp, &rect);
+        stage_end(is, STAGE_DISPLAY, start);
 
         if (rect.x != is->last_display_rect.x || rect.y != is->last_display_rect.y || rect.w != is->last_display_rect.w || rect.h != is->last_display_rect.h || is->force_refresh) {
             int bgcolor = SDL_MapRGB(screen->format, 0x00, 0x00, 0x00);
@@ -677,7 +980,7 @@ static void video_audio_display(VideoState *s)
         /* to be more precise, we take into account the time spent since
            the last buffer computation */
         if (audio_callback_time) {
-            time_diff = av_gettime() - audio_callback_time;
+            time_diff = mclock_gettime() - audio_callback_time;
             delay -= (time_diff * s->audio_tgt.freq) / 1000000;
         }
 
@@ -800,25 +1103,67 @@ static void stream_close(VideoState *is)
     int i;
     /* XXX: use a special url_shutdown call to abort parse cleanly */
     is->abort_request = 1;
-    SDL_WaitThread(is->read_tid, NULL);
+    mclock_virtual_gate(NULL, NULL);
+    wakeup_signal(&is->read_wakeup);
+    if (is->read_tid)
+        SDL_WaitThread(is->read_tid, NULL);
+    if (is->layer.tid) {
+        SDL_LockMutex(is->layer.mutex);
+        SDL_CondSignal(is->layer.cond);
+        SDL_UnlockMutex(is->layer.mutex);
+        SDL_WaitThread(is->layer.tid, NULL);
+    }
+    for (i = 0; i < LAYER_QUEUE_SIZE; i++)
+        avpicture_free(&is->layer.pictq[i].pict);
+    sws_freeContext(is->layer.sws_ctx);
+    swr_free(&is->layer.swr_ctx);
+    pcm_ring_free(&is->layer.pcm);
+    pcm_ring_free(&is->audio_ring);
+    for (i = 0; i < AUDIO_EFFECT_NB; i++)
+        av_freep(&is->effects[i].data);
+    if (is->audio_cache_tid)
+        SDL_WaitThread(is->audio_cache_tid, NULL);
+    for (i = 0; i < AUDIO_CACHE_NB; i++) {
+        av_freep(&is->audio_cache[i].data);
+        av_freep(&is->audio_cache[i].chunks);
+    }
+    loop_cache_reset(is);
     packet_queue_destroy(&is->videoq);
     packet_queue_destroy(&is->audioq);
     packet_queue_destroy(&is->subtitleq);
 
+    SDL_LockMutex(is->convert_mutex);
+    SDL_CondBroadcast(is->convert_cond);
+    SDL_UnlockMutex(is->convert_mutex);
+    if (is->convert_tid)
+        SDL_WaitThread(is->convert_tid, NULL);
+
     /* free all pictures */
     for (i = 0; i < VIDEO_PICTURE_QUEUE_SIZE; i++) {
         vp = &is->pictq[i];
+        picture_release(vp);
+        avcodec_free_frame(&vp->frame);
         if (vp->bmp) {
             SDL_FreeYUVOverlay(vp->bmp);
             vp->bmp = NULL;
         }
     }
+    free_buffer_pool(&is->buffer_pool);
     SDL_DestroyMutex(is->pictq_mutex);
     SDL_DestroyCond(is->pictq_cond);
+    SDL_DestroyMutex(is->convert_mutex);
+    SDL_DestroyCond(is->convert_cond);
     SDL_DestroyMutex(is->subpq_mutex);
     SDL_DestroyCond(is->subpq_cond);
-    SDL_DestroyCond(is->continue_read_thread);
+    SDL_DestroyMutex(is->pause_mutex);
+    SDL_DestroyCond(is->pause_cond);
+    SDL_DestroyMutex(is->pack_map_mutex);
+    SDL_DestroyMutex(is->switch_mutex);
+    SDL_DestroyMutex(is->timer_mutex);
+    SDL_DestroyMutex(is->layer.mutex);
+    SDL_DestroyCond(is->layer.cond);
     sws_freeContext(is->img_convert_ctx);
+    reclaimer_stop(&is->reclaim);
     av_free(is);
 }
 
@@ -842,6 +1187,13 @@ void sigterm_handler(int sig)
     exit(123);
 }
 
+/* a hardware double buffered mode flips at the vertical blank */
+static void present_mode_set(void)
+{
+    present_clock.vsync = display_vsync ||
+        (screen && (screen->flags & (SDL_HWSURFACE | SDL_DOUBLEBUF)) == (SDL_HWSURFACE | SDL_DOUBLEBUF));
+}
+
 int video_open(VideoState *is, int force_set_video_mode, VideoPicture *vp)
 {
     int flags = SDL_HWSURFACE | SDL_ASYNCBLIT | SDL_HWACCEL;
@@ -875,6 +1227,7 @@ int video_open(VideoState *is, int force_set_video_mode, VideoPicture *vp)
         fprintf(stderr, "SDL: could not set video mode - exiting\n");
         do_exit(is);
     }
+    present_mode_set();
     if (!window_title)
         window_title = input_filename;
     SDL_WM_SetCaption(window_title, window_title);
@@ -904,7 +1257,7 @@ static double get_audio_clock(VideoState *is)
     if (is->paused) {
         return is->audio_current_pts;
     } else {
-        return is->audio_current_pts_drift + av_gettime() / 1000000.0;
+        return is->audio_current_pts_drift + mclock_now();
     }
 }
 
@@ -916,7 +1269,7 @@ static double get_video_clock(VideoState *is)
     if (is->paused) {
         return is->video_current_pts;
     } else {
-        return is->video_current_pts_drift + av_gettime() / 1000000.0;
+        return is->video_current_pts_drift + mclock_now();
     }
 }
 
@@ -926,7 +1279,7 @@ static double get_external_clock(VideoState *is)
     if (is->paused) {
         return is->external_clock;
     } else {
-        double time = av_gettime() / 1000000.0;
+        double time = mclock_now();
         return is->external_clock_drift + time - (time - is->external_clock_time / 1000000.0) * (1.0 - is->external_clock_speed);
     }
 }
@@ -968,7 +1321,7 @@ static double get_master_clock(VideoState *is)
 
 static void update_external_clock_pts(VideoState *is, double pts)
 {
-   is->external_clock_time = av_gettime();
+   is->external_clock_time = mclock_gettime();
    is->external_clock = pts;
    is->external_clock_drift = pts - is->external_clock_time / 1000000.0;
 }
@@ -1009,7 +1362,7 @@ void stream_seek(VideoState *is, int64_t pos, int64_t rel, int seek_by_bytes)
         if (seek_by_bytes)
             is->seek_flags |= AVSEEK_FLAG_BYTE;
         is->seek_req = 1;
-        SDL_CondSignal(is->continue_read_thread);
+        wakeup_signal(&is->read_wakeup);
     }
 }
 
@@ -1017,14 +1370,27 @@ void stream_seek(VideoState *is, int64_t pos, int64_t rel, int seek_by_bytes)
 static void stream_toggle_pause(VideoState *is)
 {
     if (is->paused) {
-        is->frame_timer += av_gettime() / 1000000.0 + is->video_current_pts_drift - is->video_current_pts;
+        is->frame_timer += mclock_now() + is->video_current_pts_drift - is->video_current_pts;
         if (is->read_pause_return != AVERROR(ENOSYS)) {
-            is->video_current_pts = is->video_current_pts_drift + av_gettime() / 1000000.0;
+            is->video_current_pts = is->video_current_pts_drift + mclock_now();
         }
-        is->video_current_pts_drift = is->video_current_pts - av_gettime() / 1000000.0;
+        is->video_current_pts_drift = is->video_current_pts - mclock_now();
     }
     update_external_clock_pts(is, get_external_clock(is));
+    SDL_LockMutex(is->pause_mutex);
     is->paused = !is->paused;
+    SDL_CondBroadcast(is->pause_cond);
+    SDL_UnlockMutex(is->pause_mutex);
+    wakeup_signal(&is->audio_ring_wakeup);
+}
+
+/* block while paused, until q is aborted */
+static void wait_while_paused(VideoState *is, PacketQueue *q)
+{
+    SDL_LockMutex(is->pause_mutex);
+    while (is->paused && !q->abort_request)
+        SDL_CondWait(is->pause_cond, is->pause_mutex);
+    SDL_UnlockMutex(is->pause_mutex);
 }
 
 static void toggle_pause(VideoState *is)
@@ -1041,6 +1407,55 @@ static void step_to_next_frame(VideoState *is)
     is->step = 1;
 }
 
+/* Proportional plus integral correction of the frame delay, within
+   VIDEO_PLL_MAX_ADJUST of it, instead of dropping it to 0 or doubling it.
+   The integral takes out a steady rate difference between the clocks. */
+static double video_pll_delay(VideoState *is, double delay, double diff)
+{
+    VideoPLL *pll = &is->video_pll;
+    double now = mclock_now(), adjust;
+
+    if (pll->serial != is->videoq.serial) {
+        memset(pll, 0, sizeof(*pll));
+        pll->serial = is->videoq.serial;
+        pll->unlock_time = now;
+    } else if (pll->frame_pts == is->frame_last_pts) {
+        /* the loop runs once a frame, not once a refresh pass */
+        return fabs(pll->error) > VIDEO_PLL_CAPTURE ? -1 : delay + pll->adjust;
+    }
+    pll->frame_pts = is->frame_last_pts;
+    pll->error = diff;
+    pll->error_sq = 0.95 * pll->error_sq + 0.05 * diff * diff;
+
+    if (fabs(diff) > VIDEO_PLL_CAPTURE) {
+        pll->integral = 0;
+        pll->adjust = 0;
+        return -1;
+    }
+    pll->integral = FFMAX(FFMIN(pll->integral + diff, VIDEO_PLL_CAPTURE), -VIDEO_PLL_CAPTURE);
+    adjust = VIDEO_PLL_KP * diff + VIDEO_PLL_KI * pll->integral;
+    pll->adjust = FFMAX(FFMIN(adjust, VIDEO_PLL_MAX_ADJUST * delay), -VIDEO_PLL_MAX_ADJUST * delay);
+
+    if (pll->locked) {
+        if (fabs(diff) > VIDEO_PLL_UNLOCK) {
+            pll->locked = 0;
+            pll->lock_count = 0;
+            pll->unlocks++;
+            pll->unlock_time = now;
+            av_log(NULL, AV_LOG_VERBOSE, "video PLL lost lock, error %.3f\n", diff);
+        }
+    } else if (fabs(diff) < VIDEO_PLL_LOCK_WINDOW) {
+        if (++pll->lock_count >= VIDEO_PLL_LOCK_FRAMES) {
+            pll->locked = 1;
+            pll->lock_time = now - pll->unlock_time;
+            av_log(NULL, AV_LOG_VERBOSE, "video PLL locked after %.2fs\n", pll->lock_time);
+        }
+    } else {
+        pll->lock_count = 0;
+    }
+    return delay + pll->adjust;
+}
+
 static double compute_target_delay(double delay, VideoState *is)
 {
     double sync_threshold, diff;
@@ -1055,6 +1470,11 @@ static double compute_target_delay(double delay, VideoState *is)
            delay to compute the threshold. I still don't know
            if it is the best guess */
         sync_threshold = FFMAX(AV_SYNC_THRESHOLD, delay);
+        if (video_sync_mode == VIDEO_SYNC_PLL && !isnan(diff) && delay > 0) {
+            double pll_delay = video_pll_delay(is, delay, diff);
+            if (pll_delay >= 0)
+                return pll_delay;
+        }
         if (!isnan(diff) && fabs(diff) < AV_NOSYNC_THRESHOLD) {
             if (diff <= -sync_threshold)
                 delay = 0;
@@ -1069,38 +1489,93 @@ static double compute_target_delay(double delay, VideoState *is)
     return delay;
 }
 
+/* The picture queue has one producer, the video thread, and one consumer,
+   the display loop. Neither locks to move its index; the video thread only
+   sleeps when the queue is full (or while it drains on a flush), and the
+   display loop only takes pictq_mutex to wake it when it does. */
+
+/* video thread: sleep until the queue holds fewer than level pictures, or
+   until woken for some other reason, the caller checks again */
+static void pictq_wait(VideoState *is, int level)
+{
+    SDL_LockMutex(is->pictq_mutex);
+    is->pictq_waiting = 1;
+    __sync_synchronize();
+    if (is->pictq_size >= level && !is->videoq.abort_request)
+        SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+    is->pictq_waiting = 0;
+    SDL_UnlockMutex(is->pictq_mutex);
+}
+
+static void pictq_wake(VideoState *is)
+{
+    __sync_synchronize();
+    if (is->pictq_waiting) {
+        SDL_LockMutex(is->pictq_mutex);
+        SDL_CondSignal(is->pictq_cond);
+        SDL_UnlockMutex(is->pictq_mutex);
+    }
+}
+
 static void pictq_next_picture(VideoState *is) {
+    /* the picture dropping out behind the last displayed one goes back to
+       the video thread, which must not find it still being converted */
+    pictq_convert_wait(is, &is->pictq[(is->pictq_rindex + VIDEO_PICTURE_QUEUE_SIZE - 1) % VIDEO_PICTURE_QUEUE_SIZE], 0);
+
     /* update queue size and signal for next picture */
     if (++is->pictq_rindex == VIDEO_PICTURE_QUEUE_SIZE)
         is->pictq_rindex = 0;
 
-    SDL_LockMutex(is->pictq_mutex);
-    is->pictq_size--;
-    SDL_CondSignal(is->pictq_cond);
-    SDL_UnlockMutex(is->pictq_mutex);
+    __sync_fetch_and_sub(&is->pictq_size, 1);
+    pictq_wake(is);
 }
 
+/* The picture before pictq_rindex is the one last displayed. The video
+   thread never fills the last two free slots, so it stays in place for
+   this to step back onto. */
 static int pictq_prev_picture(VideoState *is) {
     VideoPicture *prevvp;
     int ret = 0;
-    /* update queue size and signal for the previous picture */
+    /* update queue size for the previous picture */
     prevvp = &is->pictq[(is->pictq_rindex + VIDEO_PICTURE_QUEUE_SIZE - 1) % VIDEO_PICTURE_QUEUE_SIZE];
-    if (prevvp->allocated && prevvp->serial == is->videoq.serial) {
-        SDL_LockMutex(is->pictq_mutex);
-        if (is->pictq_size < VIDEO_PICTURE_QUEUE_SIZE - 1) {
-            if (--is->pictq_rindex == -1)
-                is->pictq_rindex = VIDEO_PICTURE_QUEUE_SIZE - 1;
-            is->pictq_size++;
-            ret = 1;
-        }
-        SDL_CondSignal(is->pictq_cond);
-        SDL_UnlockMutex(is->pictq_mutex);
+    if (prevvp->allocated && prevvp->serial == is->videoq.serial &&
+        is->pictq_size < VIDEO_PICTURE_QUEUE_SIZE - 1) {
+        if (--is->pictq_rindex == -1)
+            is->pictq_rindex = VIDEO_PICTURE_QUEUE_SIZE - 1;
+        __sync_fetch_and_add(&is->pictq_size, 1);
+        ret = 1;
     }
     return ret;
 }
 
+/* Start the frame timing over once the video thread has flushed. Early
+   drops are held off until then, frame_last_pts being a stale one. */
+static void frame_timing_reset(VideoState *is)
+{
+    int serial = is->frame_reset_serial;
+
+    if (is->frame_timing_serial == serial)
+        return;
+    is->video_current_pos = -1;
+    is->frame_last_pts = AV_NOPTS_VALUE;
+    is->frame_last_duration = 0;
+    is->frame_timer = mclock_now();
+    is->frame_last_dropped_pts = AV_NOPTS_VALUE;
+    __sync_synchronize();
+    is->frame_timing_serial = serial;
+}
+
+/* Called by the video thread: is frame_last_pts the one of its serial? */
+static int frame_timing_current(VideoState *is)
+{
+    int current = is->frame_timing_serial == is->frame_reset_serial;
+
+    __sync_synchronize();
+    return current && is->frame_last_pts != AV_NOPTS_VALUE;
+}
+
 static void update_video_pts(VideoState *is, double pts, int64_t pos, int serial) {
-    double time = av_gettime() / 1000000.0;
+    double time = mclock_now();
     /* update current video pts */
     is->video_current_pts = pts;
     is->video_current_pts_drift = is->video_current_pts - time;
@@ -1116,7 +1591,7 @@ static void video_refresh(void *opaque, double *remaining_time)
 {
     VideoState *is = opaque;
     VideoPicture *vp;
-    double time;
+    double time, now;
 
     SubPicture *sp, *sp2;
 
@@ -1124,7 +1599,7 @@ static void video_refresh(void *opaque, double *remaining_time)
         check_external_clock_speed(is);
 
     if (!display_disable && is->show_mode != SHOW_MODE_VIDEO && is->audio_st) {
-        time = av_gettime() / 1000000.0;
+        time = mclock_now();
         if (is->force_refresh || is->last_vis_time + rdftspeed < time) {
             video_display(is);
             is->last_vis_time = time;
@@ -1132,22 +1607,34 @@ static void video_refresh(void *opaque, double *remaining_time)
         *remaining_time = FFMIN(*remaining_time, is->last_vis_time + rdftspeed - time);
     }
 
+    if (!is->video_st && is->audio_st && !is->paused) {
+        double clock = get_master_clock(is);
+        if (!isnan(clock))
+            media_timers_update(is, clock, is->read_eof && !is->audioq.nb_packets);
+    }
+
     if (is->video_st) {
         int redisplay = 0;
+        frame_timing_reset(is);
         if (is->force_refresh)
             redisplay = pictq_prev_picture(is);
 retry:
         if (is->pictq_size == 0) {
-            SDL_LockMutex(is->pictq_mutex);
-            if (is->frame_last_dropped_pts != AV_NOPTS_VALUE && is->frame_last_dropped_pts > is->frame_last_pts) {
-                update_video_pts(is, is->frame_last_dropped_pts, is->frame_last_dropped_pos, 0);
+            double dropped_pts = is->frame_last_dropped_pts;
+
+            /* the position was stored before the pts */
+            __sync_synchronize();
+            if (dropped_pts != AV_NOPTS_VALUE && dropped_pts > is->frame_last_pts) {
+                update_video_pts(is, dropped_pts, is->frame_last_dropped_pos, 0);
                 is->frame_last_dropped_pts = AV_NOPTS_VALUE;
             }
-            SDL_UnlockMutex(is->pictq_mutex);
             // nothing to do, no picture to display in the queue
+            if (is->read_eof && is->video_finished)
+                media_timers_update(is, 0, 1);
         } else {
             double last_duration, duration, delay;
-            /* dequeue the picture */
+            /* dequeue the picture, not read before the count said it was there */
+            __sync_synchronize();
             vp = &is->pictq[is->pictq_rindex];
 
             if (vp->serial != is->videoq.serial) {
@@ -1165,20 +1652,23 @@ retry:
                 /* if duration of the last frame was sane, update last_duration in video state */
                 is->frame_last_duration = last_duration;
             }
-            delay = compute_target_delay(is->frame_last_duration, is);
+            delay = benchmark_mode ? 0 : compute_target_delay(is->frame_last_duration, is);
 
-            time= av_gettime()/1000000.0;
+            /* pictures are timed by the refresh they will be seen at */
+            now = mclock_now();
+            time = now + (display_disable ? 0 : present_lead(&present_clock));
             if (time < is->frame_timer + delay) {
-                *remaining_time = FFMIN(is->frame_timer + delay - time, *remaining_time);
+                if (!display_disable && is->show_mode == SHOW_MODE_VIDEO)
+                    pictq_convert_ahead(is, vp);
+                *remaining_time = FFMIN(is->frame_timer + delay - now, *remaining_time);
                 return;
             }
 
             if (delay > 0)
                 is->frame_timer += delay * FFMAX(1, floor((time-is->frame_timer) / delay));
 
-            SDL_LockMutex(is->pictq_mutex);
             update_video_pts(is, vp->pts, vp->pos, vp->serial);
-            SDL_UnlockMutex(is->pictq_mutex);
+            media_timers_update(is, vp->pts, 0);
 
             if (is->pictq_size > 1) {
                 VideoPicture *nextvp = &is->pictq[(is->pictq_rindex + 1) % VIDEO_PICTURE_QUEUE_SIZE];
@@ -1197,7 +1687,7 @@ retry:
                     SDL_LockMutex(is->subpq_mutex);
 
                     while (is->subpq_size) {
-                        free_subpicture(&is->subpq[is->subpq_rindex]);
+                        free_subpicture(is, &is->subpq[is->subpq_rindex]);
 
                         /* update queue size and signal for next picture */
                         if (++is->subpq_rindex == SUBPICTURE_QUEUE_SIZE)
@@ -1221,7 +1711,7 @@ retry:
                         if ((is->video_current_pts > (sp->pts + ((float) sp->sub.end_display_time / 1000)))
                                 || (sp2 && is->video_current_pts > (sp2->pts + ((float) sp2->sub.start_display_time / 1000))))
                         {
-                            free_subpicture(sp);
+                            free_subpicture(is, sp);
 
                             /* update queue size and signal for next picture */
                             if (++is->subpq_rindex == SUBPICTURE_QUEUE_SIZE)
@@ -1238,8 +1728,14 @@ retry:
 
 display:
             /* display picture */
-            if (!display_disable && is->show_mode == SHOW_MODE_VIDEO)
+            if (!display_disable && is->show_mode == SHOW_MODE_VIDEO) {
+                double start = mclock_read() / 1000000.0;
                 video_display(is);
+                present_done(&present_clock, start, mclock_read() / 1000000.0);
+            }
+            /* straight on to the next picture */
+            if (benchmark_mode)
+                *remaining_time = 0;
 
             pictq_next_picture(is);
 
@@ -1250,11 +1746,13 @@ display:
     is->force_refresh = 0;
     if (show_status) {
         static int64_t last_time;
-        int64_t cur_time;
+        static int64_t last_rate_time, last_bytes_read;
+        static double read_rate;
+        int64_t cur_time, total;
         int aqsize, vqsize, sqsize;
         double av_diff;
 
-        cur_time = av_gettime();
+        cur_time = mclock_gettime();
         if (!last_time || (cur_time - last_time) >= 30000) {
             aqsize = 0;
             vqsize = 0;
@@ -1268,13 +1766,37 @@ display:
             av_diff = 0;
             if (is->audio_st && is->video_st)
                 av_diff = get_audio_clock(is) - get_video_clock(is);
-            printf("%7.2f A-V:%7.3f fd=%4d aq=%5dKB vq=%5dKB sq=%5dB f=%"PRId64"/%"PRId64"   \r",
+            if (cur_time - last_rate_time >= 1000000) {
+                read_rate = (is->bytes_read - last_bytes_read) * 1000000.0 / (cur_time - last_rate_time);
+                last_bytes_read = is->bytes_read;
+                last_rate_time = cur_time;
+            }
+            total = is->bytes_read + is->bytes_skipped;
+            printf("%7.2f A-V:%7.3f vd=%6d fs=%4d fd=%4d q=%d pll=%c%+6.1f/%4.1fms cs=%4d ly=%4"PRId64"/%3"PRId64" aq=%5dKB/%4dms ab=%3dms ur=%3d ac=%5"PRId64" vq=%5dKB/%4dms sq=%5dB rd=%5dKB/s io=%5dms sk=%3d%% f=%"PRId64"/%"PRId64"   \r",
                    get_master_clock(is),
                    av_diff,
+                   is->frames_decoded,
+                   is->frames_skipped,
                    is->frame_drops_early + is->frame_drops_late,
+                   is->governor.level,
+                   video_sync_mode != VIDEO_SYNC_PLL ? '-' : is->video_pll.locked ? 'L' : 'U',
+                   is->video_pll.error * 1000,
+                   sqrt(is->video_pll.error_sq) * 1000,
+                   is->conversions_saved,
+                   is->layer.blended,
+                   is->layer.skipped,
                    aqsize / 1024,
+                   (int)(is->audioq.duration / 1000),
+                   is->audio_st ? (int)(1000LL * pcm_ring_fill(&is->audio_ring) /
+                                        (is->audio_tgt.freq * is->audio_tgt.channels * av_get_bytes_per_sample(is->audio_tgt.fmt))) : 0,
+                   is->audio_underruns,
+                   is->audio_cache_hits,
                    vqsize / 1024,
+                   (int)(is->videoq.duration / 1000),
                    sqsize,
+                   (int)(read_rate / 1024),
+                   is->prefetch_pb ? (int)(prefetch_stall_time(is->prefetch_pb) / 1000) : 0,
+                   total ? (int)(100 * is->bytes_skipped / total) : 0,
                    is->video_st ? is->video_st->codec->pts_correction_num_faulty_dts : 0,
                    is->video_st ? is->video_st->codec->pts_correction_num_faulty_pts : 0);
             fflush(stdout);
@@ -1332,6 +1854,220 @@ static void duplicate_right_border_pixels(SDL_Overlay *bmp) {
     }
 }
 
+/* composite the layer over a picture being queued. Pictures due before the
+   blend could be done go out as they are. */
+static void layer_blend(VideoState *is, SDL_Overlay *bmp, double pts)
+{
+    Layer *l = &is->layer;
+    LayerPicture *lp;
+    double t, time;
+    int alpha = 256, x = 0, y = 0;
+
+    if (!l->active)
+        return;
+    SDL_LockMutex(l->mutex);
+    if (!l->active || l->req || pts < l->start)
+        goto out;
+    if (isinf(l->start))
+        l->start = pts;
+    t = pts - l->start;
+    if (l->duration > 0 && t >= l->duration) {
+        l->active = 0;
+        SDL_CondSignal(l->cond);
+        goto out;
+    }
+    if (l->mode == LAYER_FADE_OUT && l->duration > 0)
+        alpha = 256 * (1 - t / l->duration);
+
+    /* move on to the layer frame for this time */
+    while (l->size > 1 && l->pictq[(l->rindex + 1) % LAYER_QUEUE_SIZE].pts <= t + 0.001) {
+        l->rindex = (l->rindex + 1) % LAYER_QUEUE_SIZE;
+        l->size--;
+        SDL_CondSignal(l->cond);
+    }
+    lp = &l->pictq[l->rindex];
+    if (!l->size) {
+        if (l->eof)
+            l->active = 0;
+        l->skipped++;
+        goto out;
+    }
+    time = mclock_read() / 1000000.0;
+    if (lp->pts > t + 0.001 || lp->width > bmp->w || lp->height > bmp->h ||
+        pts - get_master_clock(is) < l->blend_cost) {
+        l->skipped++;
+        goto out;
+    }
+
+    if (l->mode == LAYER_PIP) {
+        x = (bmp->w - lp->width  - bmp->w / 32) & ~1;
+        y = (bmp->h - lp->height - bmp->h / 32) & ~1;
+    }
+    blend_plane(bmp->pixels[0] + y * bmp->pitches[0] + x, bmp->pitches[0],
+                lp->pict.data[0], lp->pict.linesize[0], lp->width, lp->height, alpha);
+    blend_plane(bmp->pixels[2] + y / 2 * bmp->pitches[2] + x / 2, bmp->pitches[2],
+                lp->pict.data[1], lp->pict.linesize[1], lp->width / 2, lp->height / 2, alpha);
+    blend_plane(bmp->pixels[1] + y / 2 * bmp->pitches[1] + x / 2, bmp->pitches[1],
+                lp->pict.data[2], lp->pict.linesize[2], lp->width / 2, lp->height / 2, alpha);
+    l->blend_cost = 0.9 * l->blend_cost + 0.1 * (mclock_read() / 1000000.0 - time);
+    l->blended++;
+out:
+    SDL_UnlockMutex(l->mutex);
+}
+
+/* Pictures are queued as decoded and only colour converted, with the layer
+   blended in, once the display loop has picked them: the convert thread
+   works on the picture at the head of the queue while the display loop
+   waits for its deadline, so pictures dropped late never cost a conversion. */
+
+/* let go of the decoded picture held by vp */
+static void picture_release(VideoPicture *vp)
+{
+    if (vp->frame && vp->frame->opaque) {
+        frame_buffer_unref(vp->frame->opaque);
+        vp->frame->opaque = NULL;
+    }
+}
+
+/* hold on to src_frame in vp: a reference if the decoder got its buffer
+   from our pool, a copy into the pool otherwise */
+static int picture_hold(VideoState *is, VideoPicture *vp, AVFrame *src_frame)
+{
+    AVCodecContext *avctx = is->video_dec_st->codec;
+
+    if (vp->frame && vp->frame->opaque)
+        is->conversions_saved++;
+    picture_release(vp);
+    if (!vp->frame && !(vp->frame = avcodec_alloc_frame()))
+        return AVERROR(ENOMEM);
+
+    if (avctx->get_buffer == codec_get_buffer) {
+        frame_buffer_ref(src_frame->opaque);
+        vp->frame->opaque = src_frame->opaque;
+        memcpy(vp->frame->data, src_frame->data, sizeof(src_frame->data));
+        memcpy(vp->frame->linesize, src_frame->linesize, sizeof(src_frame->linesize));
+    } else {
+        if (src_frame->width != avctx->width || src_frame->height != avctx->height ||
+            src_frame->format != avctx->pix_fmt || codec_get_buffer(avctx, vp->frame) < 0)
+            return -1;
+        av_picture_copy((AVPicture *)vp->frame, (const AVPicture *)src_frame,
+                        src_frame->format, src_frame->width, src_frame->height);
+    }
+    vp->frame->format = src_frame->format;
+    vp->frame->width  = src_frame->width;
+    vp->frame->height = src_frame->height;
+    vp->converted = 0;
+    return 0;
+}
+
+/* convert thread or display loop */
+static void picture_convert(VideoState *is, VideoPicture *vp)
+{
+    AVFrame *frame = vp->frame;
+    AVPicture pict = { { 0 } };
+    int64_t start;
+
+    if (vp->bmp && frame && frame->opaque) {
+        /* get a pointer on the bitmap */
+        SDL_LockYUVOverlay (vp->bmp);
+
+        pict.data[0] = vp->bmp->pixels[0];
+        pict.data[1] = vp->bmp->pixels[2];
+        pict.data[2] = vp->bmp->pixels[1];
+
+        pict.linesize[0] = vp->bmp->pitches[0];
+        pict.linesize[1] = vp->bmp->pitches[2];
+        pict.linesize[2] = vp->bmp->pitches[1];
+
+        av_opt_get_int(sws_opts, "sws_flags", 0, &sws_flags);
+        is->img_convert_ctx = sws_getCachedContext(is->img_convert_ctx,
+            vp->width, vp->height, frame->format, vp->width, vp->height,
+            AV_PIX_FMT_YUV420P, is->governor.level ? SWS_FAST_BILINEAR : sws_flags,
+            NULL, NULL, NULL);
+        if (is->img_convert_ctx == NULL) {
+            fprintf(stderr, "Cannot initialize the conversion context\n");
+            exit(1);
+        }
+        start = stage_begin();
+        sws_scale(is->img_convert_ctx, (const uint8_t **)frame->data, frame->linesize,
+                  0, vp->height, pict.data, pict.linesize);
+        stage_end(is, STAGE_CONVERT, start);
+
+        start = stage_begin();
+        layer_blend(is, vp->bmp, vp->pts);
+        stage_end(is, STAGE_COMPOSITE, start);
+
+        /* workaround SDL PITCH_WORKAROUND */
+        duplicate_right_border_pixels(vp->bmp);
+        /* update the bitmap content */
+        SDL_UnlockYUVOverlay(vp->bmp);
+
+        picture_release(vp);
+        is->conversions++;
+    }
+    vp->converted = 1;
+}
+
+static int convert_thread(void *arg)
+{
+    VideoState *is = arg;
+    VideoPicture *vp;
+
+    thread_name("convert");
+    SDL_LockMutex(is->convert_mutex);
+    for (;;) {
+        while (!is->convert_req && !is->abort_request)
+            SDL_CondWait(is->convert_cond, is->convert_mutex);
+        if (!(vp = is->convert_req))
+            break;
+        SDL_UnlockMutex(is->convert_mutex);
+
+        picture_convert(is, vp);
+
+        SDL_LockMutex(is->convert_mutex);
+        is->convert_req = NULL;
+        SDL_CondBroadcast(is->convert_cond);
+    }
+    SDL_UnlockMutex(is->convert_mutex);
+    return 0;
+}
+
+/* display loop: get vp converted before its deadline, if the convert thread
+   is free. convert_req is only set from here, so it is safe to peek at. */
+static void pictq_convert_ahead(VideoState *is, VideoPicture *vp)
+{
+    if (vp->converted || is->convert_req || !is->convert_tid)
+        return;
+    SDL_LockMutex(is->convert_mutex);
+    if (!vp->converted) {
+        is->convert_req = vp;
+        SDL_CondBroadcast(is->convert_cond);
+    }
+    SDL_UnlockMutex(is->convert_mutex);
+}
+
+/* display loop: wait until the convert thread is done with vp, and if
+   convert is set, until vp is converted */
+static void pictq_convert_wait(VideoState *is, VideoPicture *vp, int convert)
+{
+    if (!is->convert_tid) {
+        if (convert && !vp->converted)
+            picture_convert(is, vp);
+        return;
+    }
+    if (is->convert_req != vp && (!convert || vp->converted))
+        return;
+    SDL_LockMutex(is->convert_mutex);
+    while (is->convert_req == vp || (convert && !vp->converted)) {
+        if (!is->convert_req) {
+            is->convert_req = vp;
+            SDL_CondBroadcast(is->convert_cond);
+        }
+        SDL_CondWait(is->convert_cond, is->convert_mutex);
+    }
+    SDL_UnlockMutex(is->convert_mutex);
+}
+
 static int queue_picture(VideoState *is, AVFrame *src_frame, double pts, int64_t pos, int serial)
 {
     VideoPicture *vp;
@@ -1341,22 +2077,18 @@ static int queue_picture(VideoState *is, AVFrame *src_frame, double pts, int64_t
            av_get_picture_type_char(src_frame->pict_type), pts);
 #endif
 
-    /* wait until we have space to put a new picture */
-    SDL_LockMutex(is->pictq_mutex);
-
-    /* keep the last already displayed picture in the queue */
+    /* wait until we have space to put a new picture,
+       keeping the last already displayed picture in the queue */
     while (is->pictq_size >= VIDEO_PICTURE_QUEUE_SIZE - 2 &&
-           !is->videoq.abort_request) {
-        SDL_CondWait(is->pictq_cond, is->pictq_mutex);
-    }
-    SDL_UnlockMutex(is->pictq_mutex);
+           !is->videoq.abort_request)
+        pictq_wait(is, VIDEO_PICTURE_QUEUE_SIZE - 2);
 
     if (is->videoq.abort_request)
         return -1;
 
     vp = &is->pictq[is->pictq_windex];
 
-    vp->sample_aspect_ratio = av_guess_sample_aspect_ratio(is->ic, is->video_st, src_frame);
+    vp->sample_aspect_ratio = av_guess_sample_aspect_ratio(is->ic, is->video_dec_st, src_frame);
 
     /* alloc or resize hardware picture buffer */
     if (!vp->bmp || vp->reallocate || !vp->allocated ||
@@ -1394,77 +2126,214 @@ static int queue_picture(VideoState *is, AVFrame *src_frame, double pts, int64_t
 
     /* if the frame is not skipped, then display it */
     if (vp->bmp) {
-        AVPicture pict = { { 0 } };
-
-        /* get a pointer on the bitmap */
-        SDL_LockYUVOverlay (vp->bmp);
-
-        pict.data[0] = vp->bmp->pixels[0];
-        pict.data[1] = vp->bmp->pixels[2];
-        pict.data[2] = vp->bmp->pixels[1];
-
-        pict.linesize[0] = vp->bmp->pitches[0];
-        pict.linesize[1] = vp->bmp->pitches[2];
-        pict.linesize[2] = vp->bmp->pitches[1];
-
-        av_opt_get_int(sws_opts, "sws_flags", 0, &sws_flags);
-        is->img_convert_ctx = sws_getCachedContext(is->img_convert_ctx,
-            vp->width, vp->height, src_frame->format, vp->width, vp->height,
-            AV_PIX_FMT_YUV420P, sws_flags, NULL, NULL, NULL);
-        if (is->img_convert_ctx == NULL) {
-            fprintf(stderr, "Cannot initialize the conversion context\n");
-            exit(1);
-        }
-        sws_scale(is->img_convert_ctx, (const uint8_t **) 
-		  src_frame->data, src_frame->linesize,
-                  0, vp->height, pict.data, pict.linesize);
-
-        /* workaround SDL PITCH_WORKAROUND */
-        duplicate_right_border_pixels(vp->bmp);
-        /* update the bitmap content */
-        SDL_UnlockYUVOverlay(vp->bmp);
+        if (picture_hold(is, vp, src_frame) < 0)
+            return -1;
 
         vp->pts = pts;
         vp->pos = pos;
         vp->serial = serial;
 
-        /* now we can update the picture count */
+        /* now we can update the picture count, the barrier publishing
+           the picture before the count */
         if (++is->pictq_windex == VIDEO_PICTURE_QUEUE_SIZE)
             is->pictq_windex = 0;
-        SDL_LockMutex(is->pictq_mutex);
-        is->pictq_size++;
-        SDL_UnlockMutex(is->pictq_mutex);
+        __sync_fetch_and_add(&is->pictq_size, 1);
+        mclock_virtual_kick();
     }
     return 0;
 }
 
-static int get_video_frame(VideoState *is, AVFrame *frame, int64_t *pts, AVPacket *pkt, int *serial)
+/* move a decoder onto st, closing the one it leaves unless the reader has
+   gone back to it in the meantime */
+static void decoder_switch(VideoState *is, AVStream **dec_st, AVStream *cur_st,
+        AVStream *st)
 {
-    int got_picture;
+    SDL_LockMutex(is->switch_mutex);
+    if (*dec_st && *dec_st != cur_st)
+        avcodec_close((*dec_st)->codec);
+    *dec_st = st;
+    SDL_UnlockMutex(is->switch_mutex);
+}
 
-    if (packet_queue_get(&is->videoq, pkt, 1, serial) < 0)
-        return -1;
+/* Would the picture in pkt be late even if decoding started now? The test
+   is the one for dropping decoded frames, less what a B-frame has been
+   taking to decode. Decoding such a packet with non-reference pictures
+   skipped only loses B-frames nothing else depends on, so the packets of
+   reference pictures are not told apart. */
+static int frame_predicted_late(VideoState *is, AVPacket *pkt)
+{
+    int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    double clockdiff, dpts, ptsdiff;
 
-    if (pkt->data == flush_pkt.data) {
-        avcodec_flush_buffers(is->video_st->codec);
+    if (!(framedrop>0 || (framedrop && get_master_sync_type(is) != AV_SYNC_VIDEO_MASTER)) ||
+        !pkt->data || ts == AV_NOPTS_VALUE || !frame_timing_current(is))
+        return 0;
+    clockdiff = get_video_clock(is) - get_master_clock(is);
+    dpts = av_q2d(is->video_dec_st->time_base) * ts;
+    ptsdiff = dpts - is->frame_last_pts;
+    if (isnan(clockdiff) || fabs(clockdiff) >= AV_NOSYNC_THRESHOLD ||
+        ptsdiff <= 0 || ptsdiff >= AV_NOSYNC_THRESHOLD)
+        return 0;
+    return clockdiff + ptsdiff - is->decode_cost[AV_PICTURE_TYPE_B] - is->frame_last_filter_delay < 0;
+}
 
-        SDL_LockMutex(is->pictq_mutex);
-        // Make sure there are no long delay timers (ideally we should just flush the queue but that's harder)
-        while (is->pictq_size && !is->videoq.abort_request) {
-            SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+/* Decoder settings of each governor level, every level adding to the one
+   below and never going under what was asked for on the command line.
+   Level 1 also makes the display conversion use the fast bilinear scaler.
+   lowres is left alone: it changes the size of the decoded pictures, which
+   the decoders do not support midstream. */
+static void governor_apply(VideoState *is, AVCodecContext *avctx)
+{
+    static const struct {
+        int fast;
+        enum AVDiscard skip_loop_filter, skip_idct;
+    } levels[QUALITY_LEVELS] = {
+        { 0, AVDISCARD_DEFAULT, AVDISCARD_DEFAULT },
+        { 1, AVDISCARD_DEFAULT, AVDISCARD_DEFAULT },
+        { 1, AVDISCARD_NONREF,  AVDISCARD_DEFAULT },
+        { 1, AVDISCARD_ALL,     AVDISCARD_DEFAULT },
+        { 1, AVDISCARD_ALL,     AVDISCARD_NONREF  },
+    };
+    int level = is->governor.level;
+
+    avctx->skip_loop_filter = FFMAX(skip_loop_filter, levels[level].skip_loop_filter);
+    avctx->skip_idct        = FFMAX(skip_idct, levels[level].skip_idct);
+    if (fast || levels[level].fast)
+        avctx->flags2 |= CODEC_FLAG2_FAST;
+    else
+        avctx->flags2 &= ~CODEC_FLAG2_FAST;
+}
+
+/* Called at each key frame. One GOP with dropped frames, decoding eating
+   most of the frame time or the picture queue running dry steps the quality
+   down; it only comes back a step at a time after several GOPs decoded with
+   plenty of room. */
+static void governor_update(VideoState *is, AVCodecContext *avctx)
+{
+    QualityGovernor *g = &is->governor;
+    int drops = is->frames_skipped + is->frame_drops_early + is->frame_drops_late;
+    double budget = is->frame_last_duration, load;
+    int level = g->level;
+
+    if (g->frames < 12 || budget <= 0)
+        return;
+
+    load = g->decode_time / 1000000.0 / g->frames / budget;
+    if (drops > g->drops || load > 0.8 || g->pictq_fill < g->frames) {
+        g->calm = 0;
+        if (g->level < QUALITY_LEVELS - 1)
+            g->level++;
+    } else if (load < 0.5 && ++g->calm >= 3) {
+        g->calm = 0;
+        if (g->level > 0)
+            g->level--;
+    }
+    if (g->level != level) {
+        av_log(NULL, AV_LOG_VERBOSE, "quality level %d -> %d: load %.2f, %d drops, picture queue %.1f\n",
+               level, g->level, load, drops - g->drops, (double)g->pictq_fill / g->frames);
+        governor_apply(is, avctx);
+    }
+
+    g->frames = 0;
+    g->decode_time = 0;
+    g->pictq_fill = 0;
+    g->drops = drops;
+}
+
+static int decode_video_packet(VideoState *is, AVFrame *frame, int *got_picture, AVPacket *pkt)
+{
+    AVCodecContext *avctx = is->video_dec_st->codec;
+    enum AVDiscard skip = avctx->skip_frame;
+    /* with frame threads a picture comes out packets after its own, so the
+       skip would hit other pictures and the time taken be the wrong one's */
+    int frame_threads = avctx->active_thread_type & FF_THREAD_FRAME;
+    int late = !frame_threads && frame_predicted_late(is, pkt);
+    int64_t start;
+    double *cost;
+    int ret;
+
+    if (late)
+        avctx->skip_frame = FFMAX(skip, AVDISCARD_NONREF);
+    start = mclock_read();
+    ret = avcodec_decode_video2(avctx, frame, got_picture, pkt);
+    avctx->skip_frame = skip;
+    stage_end(is, STAGE_VIDEO_DECODE, start);
+    if (ret < 0)
+        return ret;
+
+    if (*got_picture) {
+        is->frames_decoded++;
+        if (quality_governor && !frame_threads) {
+            if (frame->key_frame)
+                governor_update(is, avctx);
+            is->governor.frames++;
+            is->governor.decode_time += mclock_read() - start;
+            is->governor.pictq_fill += is->pictq_size;
         }
-        is->video_current_pos = -1;
-        is->frame_last_pts = AV_NOPTS_VALUE;
-        is->frame_last_duration = 0;
-        is->frame_timer = (double)av_gettime() / 1000000.0;
-        is->frame_last_dropped_pts = AV_NOPTS_VALUE;
-        SDL_UnlockMutex(is->pictq_mutex);
+        if (!frame_threads && frame->pict_type > 0 && frame->pict_type <= AV_PICTURE_TYPE_BI) {
+            cost = &is->decode_cost[frame->pict_type];
+            *cost = *cost ? 0.9 * *cost + 0.1 * (mclock_read() - start) / 1000000.0
+                          : (mclock_read() - start) / 1000000.0;
+        }
+    } else if (late) {
+        /* the clock moves on as for a frame dropped after decoding */
+        is->frames_skipped++;
+        is->frame_last_dropped_pos = pkt->pos;
+        __sync_synchronize();
+        is->frame_last_dropped_pts = av_q2d(is->video_dec_st->time_base) *
+                                     (pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts);
+    }
+    return ret;
+}
+
+static int get_video_frame(VideoState *is, AVFrame *frame, int64_t *pts, AVPacket *pkt, int *serial)
+{
+    int got_picture, drained = 0;
+
+    if (!is->video_switch_pkt.data) {
+        if (packet_queue_get(&is->videoq, pkt, 1, serial) < 0)
+            return -1;
+
+        if (pkt->data && pkt->data != flush_pkt.data &&
+            is->ic->streams[pkt->stream_index] != is->video_dec_st) {
+            /* the reader has switched streams: hold the packet back until
+               the frames still delayed in the old decoder are out */
+            is->video_switch_pkt = *pkt;
+            av_init_packet(pkt);
+            pkt->data = NULL;
+            pkt->size = 0;
+        }
+    }
+
+    if (is->video_switch_pkt.data) {
+        if (avcodec_decode_video2(is->video_dec_st->codec, frame, &got_picture, pkt) >= 0 &&
+            got_picture) {
+            drained = 1;
+        } else {
+            decoder_switch(is, &is->video_dec_st, is->video_st,
+                           is->ic->streams[is->video_switch_pkt.stream_index]);
+            *pkt = is->video_switch_pkt;
+            av_init_packet(&is->video_switch_pkt);
+            is->video_switch_pkt.data = NULL;
+            is->video_switch_pkt.size = 0;
+        }
+    }
+
+    if (pkt->data == flush_pkt.data) {
+        avcodec_flush_buffers(is->video_dec_st->codec);
+
+        // Make sure there are no long delay timers (ideally we should just flush the queue but that's harder)
+        while (is->pictq_size && !is->videoq.abort_request)
+            pictq_wait(is, 1);
+        /* the frame timing belongs to video_refresh, which resets it */
+        is->frame_reset_serial = *serial;
 
         return 0;
     }
 
-    if(avcodec_decode_video2(is->video_st->codec, frame, &got_picture, pkt) < 0)
+    if (!drained && decode_video_packet(is, frame, &got_picture, pkt) < 0)
         return 0;
+    is->video_finished = !pkt->data && !got_picture;
 
     if (got_picture) {
         int ret = 1;
@@ -1482,21 +2351,21 @@ static int get_video_frame(VideoState *is, AVFrame *frame, int64_t *pts, AVPacke
         }
 
         if (framedrop>0 || (framedrop && get_master_sync_type(is) != AV_SYNC_VIDEO_MASTER)) {
-            SDL_LockMutex(is->pictq_mutex);
-            if (is->frame_last_pts != AV_NOPTS_VALUE && *pts) {
+            if (frame_timing_current(is) && *pts) {
                 double clockdiff = get_video_clock(is) - get_master_clock(is);
-                double dpts = av_q2d(is->video_st->time_base) * *pts;
+                double dpts = av_q2d(is->video_dec_st->time_base) * *pts;
                 double ptsdiff = dpts - is->frame_last_pts;
                 if (!isnan(clockdiff) && fabs(clockdiff) < AV_NOSYNC_THRESHOLD &&
                      ptsdiff > 0 && ptsdiff < AV_NOSYNC_THRESHOLD &&
                      clockdiff + ptsdiff - is->frame_last_filter_delay < 0) {
+                    /* video_refresh reads the pts first */
                     is->frame_last_dropped_pos = pkt->pos;
+                    __sync_synchronize();
                     is->frame_last_dropped_pts = dpts;
                     is->frame_drops_early++;
                     ret = 0;
                 }
             }
-            SDL_UnlockMutex(is->pictq_mutex);
         }
 
         return ret;
@@ -1514,9 +2383,9 @@ static int video_thread(void *arg)
     int ret;
     int serial = 0;
 
+    thread_name("video");
     for (;;) {
-        while (is->paused && !is->videoq.abort_request)
-            SDL_Delay(10);
+        wait_while_paused(is, &is->videoq);
 
         avcodec_get_frame_defaults(frame);
         av_free_packet(&pkt);
@@ -1528,16 +2397,17 @@ static int video_thread(void *arg)
         if (!ret)
             continue;
 
-        pts = pts_int * av_q2d(is->video_st->time_base);
+        pts = pts_int * av_q2d(is->video_dec_st->time_base);
         ret = queue_picture(is, frame, pts, pkt.pos, serial);
 
         if (ret < 0)
             goto the_end;
     }
  the_end:
-    avcodec_flush_buffers(is->video_st->codec);
+    avcodec_flush_buffers(is->video_dec_st->codec);
+    av_free_packet(&is->video_switch_pkt);
     av_free_packet(&pkt);
-    avcodec_free_frame(&frame);
+    reclaim_frame(&is->reclaim, &frame);
     return 0;
 }
 
@@ -1551,10 +2421,9 @@ static int subtitle_thread(void *arg)
     int i, j;
     int r, g, b, y, u, v, a;
 
+    thread_name("subtitle");
     for (;;) {
-        while (is->paused && !is->subtitleq.abort_request) {
-            SDL_Delay(10);
-        }
+        wait_while_paused(is, &is->subtitleq);
         if (packet_queue_get(&is->subtitleq, pkt, 1, NULL) < 0)
             break;
 
@@ -1684,14 +2553,15 @@ static int audio_decode_frame(VideoState *is)
 {
     AVPacket *pkt_temp = &is->audio_pkt_temp;
     AVPacket *pkt = &is->audio_pkt;
-    AVCodecContext *dec = is->audio_st->codec;
+    AVCodecContext *dec = is->audio_dec_st->codec;
     int len1, len2, data_size, resampled_data_size;
-    int64_t dec_channel_layout;
+    int64_t dec_channel_layout, start;
     int got_frame;
     av_unused double audio_clock0;
     int new_packet = 0;
     int flush_complete = 0;
     int wanted_nb_samples;
+    AudioConvertFunc convert;
 
     for (;;) {
         /* NOTE: the audio packet can contain several frames */
@@ -1711,7 +2581,20 @@ static int audio_decode_frame(VideoState *is)
             if (flush_complete)
                 break;
             new_packet = 0;
+
+            /* a packet decoded at startup is played from memory */
+            if (pkt_temp->data == pkt->data &&
+                (data_size = audio_cache_find(is, pkt, is->audio_pkt_index, &is->audio_buf)) > 0) {
+                pkt_temp->size = 0;
+                is->audio_clock += (double)data_size /
+                    (is->audio_tgt.channels * is->audio_tgt.freq * av_get_bytes_per_sample(is->audio_tgt.fmt));
+                is->audio_cache_hits++;
+                return data_size;
+            }
+
+            start = stage_begin();
             len1 = avcodec_decode_audio4(dec, is->frame, &got_frame, pkt_temp);
+            stage_end(is, STAGE_AUDIO_DECODE, start);
             if (len1 < 0) {
                 /* if error, we skip the frame */
                 pkt_temp->size = 0;
@@ -1736,10 +2619,22 @@ static int audio_decode_frame(VideoState *is)
                 is->frame->channel_layout : av_get_default_channel_layout(av_frame_get_channels(is->frame));
             wanted_nb_samples = synchronize_audio(is, is->frame->nb_samples);
 
-            if (is->frame->format        != is->audio_src.fmt            ||
+            /* without a rate change or compensation, only the layout of the
+               samples differs from what the device takes */
+            convert = NULL;
+            if (is->frame->sample_rate == is->audio_tgt.freq && wanted_nb_samples == is->frame->nb_samples)
+                convert = audio_convert_find(is->frame->format, av_frame_get_channels(is->frame),
+                                             is->audio_tgt.fmt, is->audio_tgt.channels);
+            if (convert && is->swr_ctx) {
+                swr_free(&is->swr_ctx);
+                is->audio_src = is->audio_tgt;
+            }
+
+            if (!convert &&
+                (is->frame->format       != is->audio_src.fmt            ||
                 dec_channel_layout       != is->audio_src.channel_layout ||
                 is->frame->sample_rate   != is->audio_src.freq           ||
-                (wanted_nb_samples       != is->frame->nb_samples && !is->swr_ctx)) {
+                (wanted_nb_samples       != is->frame->nb_samples && !is->swr_ctx))) {
                 swr_free(&is->swr_ctx);
                 is->swr_ctx = swr_alloc_set_opts(NULL,
                                                  is->audio_tgt.channel_layout, is->audio_tgt.fmt, is->audio_tgt.freq,
@@ -1757,7 +2652,15 @@ static int audio_decode_frame(VideoState *is)
                 is->audio_src.fmt = is->frame->format;
             }
 
-            if (is->swr_ctx) {
+            if (convert) {
+                resampled_data_size = is->frame->nb_samples * is->audio_tgt.channels * av_get_bytes_per_sample(is->audio_tgt.fmt);
+                av_fast_malloc(&is->audio_buf1, &is->audio_buf1_size, resampled_data_size);
+                if (!is->audio_buf1)
+                    return AVERROR(ENOMEM);
+                convert((int16_t *)is->audio_buf1, (const uint8_t * const *)is->frame->extended_data,
+                        is->frame->nb_samples, av_frame_get_channels(is->frame));
+                is->audio_buf = is->audio_buf1;
+            } else if (is->swr_ctx) {
                 const uint8_t **in = (const uint8_t **)is->frame->extended_data;
                 uint8_t **out = &is->audio_buf1;
                 int out_count = (int64_t)wanted_nb_samples * is->audio_tgt.freq / is->frame->sample_rate + 256;
@@ -1812,9 +2715,6 @@ static int audio_decode_frame(VideoState *is)
             return -1;
         }
 
-        if (is->audioq.nb_packets == 0)
-            SDL_CondSignal(is->continue_read_thread);
-
         /* read next packet */
         if ((new_packet = packet_queue_get(&is->audioq, pkt, 1, &is->audio_pkt_temp_serial)) < 0)
             return -1;
@@ -1822,70 +2722,257 @@ static int audio_decode_frame(VideoState *is)
         if (pkt->data == flush_pkt.data) {
             avcodec_flush_buffers(dec);
             flush_complete = 0;
+            is->audio_pkt_pos = -1;
+        } else if (pkt->data && is->ic->streams[pkt->stream_index] != is->audio_dec_st) {
+            /* the reader has switched streams, follow it */
+            decoder_switch(is, &is->audio_dec_st, is->audio_st,
+                           is->ic->streams[pkt->stream_index]);
+            dec = is->audio_dec_st->codec;
+            flush_complete = 0;
+        }
+        /* counted as the cache does, which leaves out packets without a pos */
+        if (pkt->data && pkt->data != flush_pkt.data && pkt->pos >= 0) {
+            is->audio_pkt_index = pkt->pos == is->audio_pkt_pos ? is->audio_pkt_index + 1 : 0;
+            is->audio_pkt_pos   = pkt->pos;
         }
 
         *pkt_temp = *pkt;
 
         /* if update the audio clock with the pts */
         if (pkt->pts != AV_NOPTS_VALUE) {
-            is->audio_clock = av_q2d(is->audio_st->time_base)*pkt->pts;
+            is->audio_clock = av_q2d(is->audio_dec_st->time_base)*pkt->pts;
             is->audio_clock_serial = is->audio_pkt_temp_serial;
         }
     }
 }
 
+/* mix the effects which are playing into the chunk going to the device */
+static void audio_mix_effects(VideoState *is, Uint8 *stream, int len)
+{
+    unsigned pending = __sync_fetch_and_and(&is->effects_pending, 0);
+    AudioEffect *e;
+    int i, n;
+
+    for (i = 0; i < nb_audio_effects; i++) {
+        e = &is->effects[i];
+        if (pending & (1U << i))
+            e->pos = 0;
+        if (!e->data || e->pos < 0)
+            continue;
+        n = FFMIN(len, e->size - e->pos);
+        mix_add_s16((int16_t *)stream, (const int16_t *)(e->data + e->pos), n / 2);
+        e->pos += n;
+        if (e->pos >= e->size)
+            e->pos = -1;
+    }
+}
+
+/* fade the audio of the clip left by a crossfade out over the new one */
+static void audio_mix_layer(VideoState *is, Uint8 *stream, int len, double pts)
+{
+    Layer *l = &is->layer;
+    int16_t buf[1024];
+    int frame_size = is->audio_tgt.channels * av_get_bytes_per_sample(is->audio_tgt.fmt);
+    int n;
+
+    if (l->pcm_reset) {
+        l->pcm_reset = 0;
+        pcm_ring_drop(&l->pcm);
+        l->pcm_gain = l->duration > 0 ? 32767 : 0;
+    }
+    if (l->pcm_gain <= 0 || pts < l->start)
+        return;
+    while (len > 0 && l->pcm_gain > 0) {
+        n = pcm_ring_read(&l->pcm, (uint8_t *)buf, FFMIN(len, sizeof(buf)) / frame_size * frame_size);
+        if (n <= 0)
+            break;
+        mix_fade_s16((int16_t *)stream, buf, n / 2, 32767, l->pcm_gain);
+        l->pcm_gain -= lrint(32767.0 * (n / frame_size) / (l->duration * is->audio_tgt.freq));
+        stream += n;
+        len    -= n;
+    }
+}
+
+/* how far the audio thread decodes ahead of the device, in bytes */
+static int audio_ring_target(VideoState *is)
+{
+    int bytes_per_sec = is->audio_tgt.freq * is->audio_tgt.channels *
+                        av_get_bytes_per_sample(is->audio_tgt.fmt);
+
+    return FFMIN((int64_t)audio_ring_ms * bytes_per_sec / 1000, AUDIO_RING_SIZE / 2);
+}
+
+/* On virtual time decoding takes no time at all, so the clock is held
+   until the decoders have what the callback and the display will ask for
+   next. What this looks at either changes on the display thread, itself
+   asleep on the clock when it matters, or kicks the clock. */
+static int simulation_ready(void *opaque)
+{
+    VideoState *is = opaque;
+
+    if (is->paused || is->abort_request)
+        return 1;
+    if (is->audio_st && !is->audioq.abort_request &&
+        pcm_ring_fill(&is->audio_ring) < FFMIN(is->audio_hw_buf_size, audio_ring_target(is)) &&
+        (is->audioq.nb_packets || !is->read_eof))
+        return 0;
+    return !is->video_st || is->videoq.abort_request ||
+           is->pictq_size || is->video_finished;
+}
+
 /* prepare a new audio buffer */
 static void sdl_audio_callback(void *opaque, Uint8 *stream, int len)
 {
     VideoState *is = opaque;
-    int audio_size, len1;
-    int bytes_per_sec;
-    int frame_size = av_samples_get_buffer_size(NULL, is->audio_tgt.channels, 1, is->audio_tgt.fmt, 1);
-
-    audio_callback_time = av_gettime();
-
-    while (len > 0) {
-        if (is->audio_buf_index >= is->audio_buf_size) {
-           audio_size = audio_decode_frame(is);
-           if (audio_size < 0) {
-                /* if error, just output silence */
-               is->audio_buf      = is->silence_buf;
-               is->audio_buf_size = sizeof(is->silence_buf) / frame_size * frame_size;
-           } else {
-               if (is->show_mode != SHOW_MODE_VIDEO)
-                   update_sample_display(is, (int16_t *)is->audio_buf, audio_size);
-               is->audio_buf_size = audio_size;
-           }
-           is->audio_buf_index = 0;
-        }
-        len1 = is->audio_buf_size - is->audio_buf_index;
-        if (len1 > len)
-            len1 = len;
-        memcpy(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1);
-        len -= len1;
-        stream += len1;
-        is->audio_buf_index += len1;
-    }
+    int bytes_per_sec, n, serial;
+    unsigned seq, windex;
+    double clock, chunk_pts;
+
+    audio_callback_time = mclock_gettime();
     bytes_per_sec = is->audio_tgt.freq * is->audio_tgt.channels * av_get_bytes_per_sample(is->audio_tgt.fmt);
-    is->audio_write_buf_size = is->audio_buf_size - is->audio_buf_index;
-    /* Let's assume the audio driver that is used by SDL has two periods. */
-    is->audio_current_pts = is->audio_clock - (double)(2 * is->audio_hw_buf_size + is->audio_write_buf_size) / bytes_per_sec;
+
+    /* what the decoder thread has published of its clock */
+    do {
+        seq     = is->audio_clock_seq;
+        __sync_synchronize();
+        windex  = is->audio_clock_windex;
+        clock   = is->audio_clock_pts;
+        serial  = is->audio_clock_pub_serial;
+        __sync_synchronize();
+    } while ((seq & 1) || seq != is->audio_clock_seq);
+
+    /* the queues were flushed, what is in the ring is stale */
+    if (is->audio_drop_seen != is->audio_drop_seq) {
+        is->audio_drop_seen = is->audio_drop_seq;
+        if ((int)(is->audio_drop_index - is->audio_ring.rindex) > 0)
+            is->audio_ring.rindex = is->audio_drop_index;
+    }
+
+    chunk_pts = clock - (double)(int)(windex - is->audio_ring.rindex) / bytes_per_sec;
+    n = is->paused ? 0 : pcm_ring_read(&is->audio_ring, stream, len);
+    if (n < len) {
+        memset(stream + n, 0, len - n);
+        if (!is->paused && !is->read_eof)
+            is->audio_underruns++;
+    }
+    if (n > 0)
+        wakeup_signal(&is->audio_ring_wakeup);
+
+    if (is->layer.pcm.data)
+        audio_mix_layer(is, stream, len, chunk_pts);
+    audio_mix_effects(is, stream, len);
+
+    is->audio_write_buf_size = (int)(windex - is->audio_ring.rindex);
+    if (is->audio_hw_delay >= 0) {
+        /* what the device still holds plays before this chunk */
+        is->audio_current_pts = clock - (double)(is->audio_hw_delay + len + is->audio_write_buf_size) / bytes_per_sec;
+    } else {
+        /* Let's assume the audio driver that is used by SDL has two periods. */
+        is->audio_current_pts = clock - (double)(2 * is->audio_hw_buf_size + is->audio_write_buf_size) / bytes_per_sec;
+    }
     is->audio_current_pts_drift = is->audio_current_pts - audio_callback_time / 1000000.0;
-    if (is->audioq.serial == is->audio_clock_serial)
+    if (is->audioq.serial == serial)
         check_external_clock_sync(is, is->audio_current_pts);
 }
 
+/* decode ahead of the device into the audio ring, so that a slow packet or
+   decode never makes the callback late */
+static int audio_thread(void *arg)
+{
+    VideoState *is = arg;
+    int audio_size, n, last_serial = -1;
+    uint8_t *buf;
+
+    thread_name("audio");
+    while (!is->audioq.abort_request) {
+        if (is->paused || pcm_ring_fill(&is->audio_ring) >= audio_ring_target(is)) {
+            wakeup_wait(&is->audio_ring_wakeup, 0);
+            continue;
+        }
+
+        audio_size = audio_decode_frame(is);
+        if (audio_size < 0)
+            continue;
+        if (is->show_mode != SHOW_MODE_VIDEO)
+            update_sample_display(is, (int16_t *)is->audio_buf, audio_size);
+
+        if (is->audio_pkt_temp_serial != last_serial) {
+            last_serial = is->audio_pkt_temp_serial;
+            is->audio_drop_index = is->audio_ring.windex;
+            __sync_synchronize();
+            is->audio_drop_seq++;
+        }
+        for (buf = is->audio_buf; audio_size > 0 && !is->audioq.abort_request; ) {
+            n = pcm_ring_write(&is->audio_ring, buf, audio_size);
+            buf        += n;
+            audio_size -= n;
+            if (audio_size > 0)
+                wakeup_wait(&is->audio_ring_wakeup, 0);
+        }
+
+        is->audio_clock_seq++;
+        __sync_synchronize();
+        is->audio_clock_windex     = is->audio_ring.windex;
+        is->audio_clock_pts        = is->audio_clock;
+        is->audio_clock_pub_serial = is->audio_clock_serial;
+        __sync_synchronize();
+        is->audio_clock_seq++;
+        mclock_virtual_kick();
+    }
+    return 0;
+}
+
+static void alsa_audio_callback(void *opaque, uint8_t *stream, int len, int delay)
+{
+    VideoState *is = opaque;
+
+    is->audio_hw_delay = delay * is->audio_tgt.channels * av_get_bytes_per_sample(is->audio_tgt.fmt);
+    sdl_audio_callback(opaque, stream, len);
+}
+
+/* open the ALSA device named by audio_device, so that the clock can use the
+   real output delay. Returns the period size in bytes. */
+static int audio_open_alsa(VideoState *is, int64_t channel_layout, int nb_channels, int sample_rate, struct AudioParams *audio_hw_params)
+{
+    int ret;
+
+    if (!channel_layout || nb_channels != av_get_channel_layout_nb_channels(channel_layout))
+        channel_layout = av_get_default_channel_layout(nb_channels);
+    channel_layout &= ~AV_CH_LAYOUT_STEREO_DOWNMIX;
+    nb_channels = av_get_channel_layout_nb_channels(channel_layout);
+    if ((ret = alsa_output_open(&is->alsa, audio_device, nb_channels, &sample_rate,
+                                audio_buffer_size, audio_periods, alsa_audio_callback, is)) < 0) {
+        fprintf(stderr, "%s: %s, falling back to SDL audio\n", audio_device, snd_strerror(ret));
+        return -1;
+    }
+    audio_hw_params->fmt = AV_SAMPLE_FMT_S16;
+    audio_hw_params->freq = sample_rate;
+    audio_hw_params->channel_layout = channel_layout;
+    audio_hw_params->channels = nb_channels;
+    is->audio_hw_delay = 0;
+    is->alsa.unpaced = benchmark_mode;
+    printf("%s: %s, %d frames x %d periods at %d Hz\n", audio_device,
+           is->alsa.mmap ? "mmap" : "read/write", is->alsa.period_size,
+           is->alsa.buffer_size / is->alsa.period_size, sample_rate);
+    return is->alsa.period_size * nb_channels * 2;
+}
+
 static int audio_open(void *opaque, int64_t wanted_channel_layout, int wanted_nb_channels, int wanted_sample_rate, struct AudioParams *audio_hw_params)
 {
     SDL_AudioSpec wanted_spec, spec;
     const char *env;
     const int next_nb_channels[] = {0, 0, 1, 6, 2, 6, 4, 6};
+    int ret;
 
     env = SDL_getenv("SDL_AUDIO_CHANNELS");
     if (env) {
         wanted_nb_channels = atoi(env);
         wanted_channel_layout = av_get_default_channel_layout(wanted_nb_channels);
     }
+    if (audio_device && wanted_sample_rate > 0 &&
+        (ret = audio_open_alsa(opaque, wanted_channel_layout, wanted_nb_channels, wanted_sample_rate, audio_hw_params)) >= 0)
+        return ret;
+    ((VideoState *)opaque)->audio_hw_delay = -1;
     if (!wanted_channel_layout || wanted_nb_channels != av_get_channel_layout_nb_channels(wanted_channel_layout)) {
         wanted_channel_layout = av_get_default_channel_layout(wanted_nb_channels);
         wanted_channel_layout &= ~AV_CH_LAYOUT_STEREO_DOWNMIX;
@@ -1898,7 +2985,7 @@ static int audio_open(void *opaque, int64_t wanted_channel_layout, int wanted_nb
     }
     wanted_spec.format = AUDIO_S16SYS;
     wanted_spec.silence = 0;
-    wanted_spec.samples = SDL_AUDIO_BUFFER_SIZE;
+    wanted_spec.samples = audio_buffer_size;
     wanted_spec.callback = sdl_audio_callback;
     wanted_spec.userdata = opaque;
     while (SDL_OpenAudio(&wanted_spec, &spec) < 0) {
@@ -1914,233 +3001,1460 @@ static int audio_open(void *opaque, int64_t wanted_channel_layout, int wanted_nb
         fprintf(stderr, "SDL advised audio format %d is not supported!\n", spec.format);
         return -1;
     }
-    if (spec.channels != wanted_spec.channels) {
-        wanted_channel_layout = av_get_default_channel_layout(spec.channels);
-        if (!wanted_channel_layout) {
-            fprintf(stderr, "SDL advised channel count %d is not supported!\n", spec.channels);
-            return -1;
+    if (spec.channels != wanted_spec.channels) {
+        wanted_channel_layout = av_get_default_channel_layout(spec.channels);
+        if (!wanted_channel_layout) {
+            fprintf(stderr, "SDL advised channel count %d is not supported!\n", spec.channels);
+            return -1;
+        }
+    }
+
+    audio_hw_params->fmt = AV_SAMPLE_FMT_S16;
+    audio_hw_params->freq = spec.freq;
+    audio_hw_params->channel_layout = wanted_channel_layout;
+    audio_hw_params->channels =  spec.channels;
+    return spec.size;
+}
+
+/* decode a whole sound file into the device format */
+static int audio_effect_decode(const char *filename, struct AudioParams *tgt, AudioEffect *e)
+{
+    AVFormatContext *ic = NULL;
+    AVCodecContext *avctx = NULL;
+    AVCodec *codec;
+    AVFrame *frame = NULL;
+    AVPacket pkt, pkt_temp;
+    struct SwrContext *swr_ctx = NULL;
+    uint8_t *out;
+    int64_t layout;
+    int stream, got_frame, ret, len, out_count;
+    int frame_size = tgt->channels * av_get_bytes_per_sample(tgt->fmt);
+
+    if ((ret = avformat_open_input(&ic, filename, NULL, NULL)) < 0)
+        return ret;
+    if ((ret = avformat_find_stream_info(ic, NULL)) < 0)
+        goto fail;
+    if ((ret = stream = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0)) < 0)
+        goto fail;
+    if ((ret = avcodec_open2(ic->streams[stream]->codec, codec, NULL)) < 0)
+        goto fail;
+    avctx = ic->streams[stream]->codec;
+    frame = avcodec_alloc_frame();
+
+    while (ret >= 0 && av_read_frame(ic, &pkt) >= 0) {
+        pkt_temp = pkt;
+        while (pkt.stream_index == stream && pkt_temp.size > 0) {
+            avcodec_get_frame_defaults(frame);
+            if ((len = avcodec_decode_audio4(avctx, frame, &got_frame, &pkt_temp)) < 0)
+                break;
+            pkt_temp.data += len;
+            pkt_temp.size -= len;
+            if (!got_frame)
+                continue;
+            if (!swr_ctx) {
+                layout = (frame->channel_layout &&
+                          av_frame_get_channels(frame) == av_get_channel_layout_nb_channels(frame->channel_layout)) ?
+                         frame->channel_layout : av_get_default_channel_layout(av_frame_get_channels(frame));
+                swr_ctx = swr_alloc_set_opts(NULL, tgt->channel_layout, tgt->fmt, tgt->freq,
+                                             layout, frame->format, frame->sample_rate, 0, NULL);
+                if (!swr_ctx || swr_init(swr_ctx) < 0) {
+                    ret = AVERROR(EINVAL);
+                    break;
+                }
+            }
+            out_count = (int64_t)frame->nb_samples * tgt->freq / frame->sample_rate + 256;
+            if (!(out = av_realloc(e->data, e->size + out_count * frame_size))) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            e->data = out;
+            out += e->size;
+            len = swr_convert(swr_ctx, &out, out_count, (const uint8_t **)frame->extended_data, frame->nb_samples);
+            if (len > 0)
+                e->size += len * frame_size;
+        }
+        av_free_packet(&pkt);
+    }
+    if (ret >= 0 && !e->size)
+        ret = AVERROR_INVALIDDATA;
+fail:
+    if (ret < 0) {
+        av_freep(&e->data);
+        e->size = 0;
+    }
+    e->pos = -1;
+    swr_free(&swr_ctx);
+    avcodec_free_frame(&frame);
+    if (avctx)
+        avcodec_close(avctx);
+    avformat_close_input(&ic);
+    return ret < 0 ? ret : 0;
+}
+
+/* (re)decode the effects for the device just opened. The audio callback
+   is not running yet. */
+static void audio_effects_load(VideoState *is)
+{
+    int i;
+
+    for (i = 0; i < nb_audio_effects; i++) {
+        av_freep(&is->effects[i].data);
+        is->effects[i].size = 0;
+        if (audio_effect_decode(audio_effect_files[i], &is->audio_tgt, &is->effects[i]) < 0)
+            fprintf(stderr, "%s: could not load sound effect\n", audio_effect_files[i]);
+    }
+}
+
+/* register a sound to be preloaded when audio output starts, returns its
+   number for audio_effect_play() */
+int audio_effect_add(const char *filename)
+{
+    if (nb_audio_effects >= AUDIO_EFFECT_NB)
+        return -1;
+    audio_effect_files[nb_audio_effects] = filename;
+    return nb_audio_effects++;
+}
+
+/* start (or restart) an effect with the next chunk the device asks for.
+   Safe to call from any thread. */
+void audio_effect_play(VideoState *is, int effect)
+{
+    if (effect >= 0 && effect < nb_audio_effects)
+        __sync_fetch_and_or(&is->effects_pending, 1U << effect);
+}
+
+/* register an audio stream to be decoded in full once audio output has
+   started, returns < 0 if too many are already registered */
+int audio_cache_add(int stream_index)
+{
+    if (nb_audio_cache_streams >= AUDIO_CACHE_NB || stream_index < 0)
+        return -1;
+    audio_cache_streams[nb_audio_cache_streams] = stream_index;
+    return nb_audio_cache_streams++;
+}
+
+/* size of the PCM decoded from pkt, the index-th packet of its stream at
+   its pos, 0 if it is not cached */
+static int audio_cache_find(VideoState *is, AVPacket *pkt, int index, uint8_t **buf)
+{
+    AudioCache *c;
+    int i, lo, hi, mid, nb = is->nb_audio_cache;
+
+    if (pkt->pos < 0)
+        return 0;
+    __sync_synchronize();
+    for (i = 0; i < nb; i++) {
+        c = &is->audio_cache[i];
+        if (c->stream != pkt->stream_index)
+            continue;
+        lo = 0;
+        hi = c->nb_chunks;
+        while (lo < hi) {
+            mid = (lo + hi) >> 1;
+            if (c->chunks[mid].pos < pkt->pos ||
+                (c->chunks[mid].pos == pkt->pos && c->chunks[mid].index < index))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == c->nb_chunks || c->chunks[lo].pos != pkt->pos ||
+            c->chunks[lo].index != index)
+            return 0;
+        *buf = c->data + c->chunks[lo].offset;
+        return c->chunks[lo].size;
+    }
+    return 0;
+}
+
+static int audio_cache_append(AudioCache *c, struct SwrContext **swr_ctx,
+                              struct AudioParams *tgt, AVFrame *frame)
+{
+    int frame_size = tgt->channels * av_get_bytes_per_sample(tgt->fmt);
+    int out_count = (int64_t)frame->nb_samples * tgt->freq / frame->sample_rate + 256;
+    int64_t layout;
+    uint8_t *out;
+    int len;
+
+    if (!*swr_ctx) {
+        layout = (frame->channel_layout &&
+                  av_frame_get_channels(frame) == av_get_channel_layout_nb_channels(frame->channel_layout)) ?
+                 frame->channel_layout : av_get_default_channel_layout(av_frame_get_channels(frame));
+        *swr_ctx = swr_alloc_set_opts(NULL, tgt->channel_layout, tgt->fmt, tgt->freq,
+                                      layout, frame->format, frame->sample_rate, 0, NULL);
+        if (!*swr_ctx || swr_init(*swr_ctx) < 0)
+            return AVERROR(EINVAL);
+    }
+    if (c->size + (int64_t)out_count * frame_size > audio_cache_max)
+        return AVERROR(ENOSPC);
+    if (!(out = av_realloc(c->data, c->size + out_count * frame_size)))
+        return AVERROR(ENOMEM);
+    c->data = out;
+    out += c->size;
+    len = swr_convert(*swr_ctx, &out, out_count, (const uint8_t **)frame->extended_data, frame->nb_samples);
+    if (len > 0)
+        c->size += len * frame_size;
+    return 0;
+}
+
+/* decode the registered streams in one pass over the file, in the format
+   of the device just opened, and publish them to audio_decode_frame() */
+static int audio_cache_thread(void *arg)
+{
+    VideoState *is = arg;
+    AVFormatContext *ic = NULL;
+    AVCodecContext *avctx;
+    AVCodec *codec;
+    AVFrame *frame = NULL;
+    AVPacket pkt, pkt_temp;
+    AudioCache cache[AUDIO_CACHE_NB], *c;
+    AudioCacheChunk *chunk;
+    struct SwrContext *swr_ctx[AUDIO_CACHE_NB] = { NULL };
+    int err[AUDIO_CACHE_NB] = { 0 };
+    int i, j, nb = 0, got_frame, len;
+
+    thread_name("audio cache");
+    memset(cache, 0, sizeof(cache));
+    if (avformat_open_input(&ic, is->filename, is->iformat, NULL) < 0 ||
+        avformat_find_stream_info(ic, NULL) < 0)
+        goto fail;
+    for (i = 0; i < ic->nb_streams; i++)
+        ic->streams[i]->discard = AVDISCARD_ALL;
+    for (i = 0; i < nb_audio_cache_streams; i++) {
+        j = audio_cache_streams[i];
+        if (j >= ic->nb_streams || ic->streams[j]->codec->codec_type != AVMEDIA_TYPE_AUDIO ||
+            !(codec = avcodec_find_decoder(ic->streams[j]->codec->codec_id)) ||
+            avcodec_open2(ic->streams[j]->codec, codec, NULL) < 0) {
+            fprintf(stderr, "audio cache: cannot decode stream %d\n", j);
+            continue;
+        }
+        ic->streams[j]->discard = AVDISCARD_DEFAULT;
+        cache[nb++].stream = j;
+    }
+    frame = avcodec_alloc_frame();
+
+    while (nb && !is->abort_request && av_read_frame(ic, &pkt) >= 0) {
+        for (i = 0; i < nb && cache[i].stream != pkt.stream_index; i++)
+            ;
+        c = &cache[i];
+        if (i == nb || err[i] || pkt.pos < 0) {
+            av_free_packet(&pkt);
+            continue;
+        }
+        if (!(c->nb_chunks & (c->nb_chunks - 1))) {
+            chunk = av_realloc(c->chunks, FFMAX(16, 2 * c->nb_chunks) * sizeof(*chunk));
+            if (!chunk) {
+                err[i] = AVERROR(ENOMEM);
+                av_free_packet(&pkt);
+                continue;
+            }
+            c->chunks = chunk;
+        }
+        chunk = &c->chunks[c->nb_chunks++];
+        chunk->pos = pkt.pos;
+        chunk->index = c->nb_chunks > 1 && chunk[-1].pos == pkt.pos ? chunk[-1].index + 1 : 0;
+        chunk->offset = c->size;
+
+        avctx = ic->streams[c->stream]->codec;
+        pkt_temp = pkt;
+        while (pkt_temp.size > 0 && !err[i]) {
+            avcodec_get_frame_defaults(frame);
+            if ((len = avcodec_decode_audio4(avctx, frame, &got_frame, &pkt_temp)) < 0)
+                break;
+            pkt_temp.data += len;
+            pkt_temp.size -= len;
+            if (got_frame)
+                err[i] = audio_cache_append(c, &swr_ctx[i], &is->audio_tgt, frame);
+        }
+        chunk->size = c->size - chunk->offset;
+        av_free_packet(&pkt);
+    }
+
+    /* streams that could not be cached in full are played as usual */
+    for (i = j = 0; i < nb; i++) {
+        if (err[i] || is->abort_request) {
+            fprintf(stderr, "audio cache: stream %d not cached (%s)\n", cache[i].stream,
+                    err[i] == AVERROR(ENOSPC) ? "over the size limit" : "error");
+            av_freep(&cache[i].data);
+            av_freep(&cache[i].chunks);
+            continue;
+        }
+        fprintf(stderr, "audio cache: stream %d, %d packets, %d KB, %.2f s\n",
+                cache[i].stream, cache[i].nb_chunks, cache[i].size / 1024,
+                (double)cache[i].size / (is->audio_tgt.channels * is->audio_tgt.freq *
+                                         av_get_bytes_per_sample(is->audio_tgt.fmt)));
+        is->audio_cache[j++] = cache[i];
+    }
+    __sync_synchronize();
+    is->nb_audio_cache = j;
+
+fail:
+    for (i = 0; i < AUDIO_CACHE_NB; i++)
+        swr_free(&swr_ctx[i]);
+    avcodec_free_frame(&frame);
+    if (ic)
+        for (i = 0; i < ic->nb_streams; i++)
+            if (avcodec_is_open(ic->streams[i]->codec))
+                avcodec_close(ic->streams[i]->codec);
+    avformat_close_input(&ic);
+    return 0;
+}
+
+/* decoder threads for a video stream. With layers the cores are split
+   between the main and the layer decoder, rather than both taking them all. */
+static int video_threads(int layer)
+{
+    int budget = thread_budget > 0 ? thread_budget : sysconf(_SC_NPROCESSORS_ONLN);
+    int share  = layer_enable ? budget / 2 : 0;
+
+    return FFMAX(1, layer ? share : budget - share);
+}
+
+/* find and open the decoder of a stream, without starting anything */
+static int stream_open_codec(VideoState *is, int stream_index)
+{
+    AVFormatContext *ic = is->ic;
+    AVCodecContext *avctx;
+    AVCodec *codec;
+    const char *forced_codec_name = NULL;
+    AVDictionary *opts;
+    AVDictionaryEntry *t = NULL;
+
+    avctx = ic->streams[stream_index]->codec;
+
+    codec = avcodec_find_decoder(avctx->codec_id);
+
+    switch(avctx->codec_type){
+        case AVMEDIA_TYPE_AUDIO   : forced_codec_name =    audio_codec_name; break;
+        case AVMEDIA_TYPE_SUBTITLE: forced_codec_name = subtitle_codec_name; break;
+        case AVMEDIA_TYPE_VIDEO   : forced_codec_name =    video_codec_name; break;
+	default:
+	    break;
+    }
+    if (forced_codec_name)
+        codec = avcodec_find_decoder_by_name(forced_codec_name);
+    if (!codec) {
+        if (forced_codec_name) fprintf(stderr, "No codec could be found with name '%s'\n", forced_codec_name);
+        else                   fprintf(stderr, "No codec could be found with id %d\n", avctx->codec_id);
+        return -1;
+    }
+
+    avctx->codec_id = codec->id;
+    avctx->workaround_bugs   = workaround_bugs;
+    avctx->lowres            = lowres;
+    if(avctx->lowres > codec->max_lowres){
+        av_log(avctx, AV_LOG_WARNING, "The maximum value for lowres supported by the decoder is %d\n",
+                codec->max_lowres);
+        avctx->lowres= codec->max_lowres;
+    }
+    avctx->idct_algo         = idct;
+    avctx->skip_frame        = skip_frame;
+    avctx->skip_idct         = skip_idct;
+    avctx->skip_loop_filter  = skip_loop_filter;
+    avctx->error_concealment = error_concealment;
+
+    if(avctx->lowres) avctx->flags |= CODEC_FLAG_EMU_EDGE;
+    if (fast)   avctx->flags2 |= CODEC_FLAG2_FAST;
+    if(codec->capabilities & CODEC_CAP_DR1)
+        avctx->flags |= CODEC_FLAG_EMU_EDGE;
+    if (avctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+        /* the picture queue keeps references to the decoded pictures */
+        avctx->opaque = &is->buffer_pool;
+        governor_apply(is, avctx);
+        if (codec->capabilities & CODEC_CAP_DR1) {
+            avctx->get_buffer     = codec_get_buffer;
+            avctx->release_buffer = codec_release_buffer;
+        }
+    }
+
+    opts = filter_codec_opts(codec_opts, avctx->codec_id, ic, ic->streams[stream_index], codec);
+    if (!av_dict_get(opts, "threads", NULL, 0)) {
+        if (avctx->codec_type == AVMEDIA_TYPE_VIDEO && (layer_enable || thread_budget > 0)) {
+            char threads[16];
+            snprintf(threads, sizeof(threads), "%d", video_threads(0));
+            av_dict_set(&opts, "threads", threads, 0);
+        } else {
+            av_dict_set(&opts, "threads", "auto", 0);
+        }
+    }
+    if (avcodec_open2(avctx, codec, &opts) < 0)
+        return -1;
+    if ((t = av_dict_get(opts, "", NULL, AV_DICT_IGNORE_SUFFIX))) {
+        av_log(NULL, AV_LOG_ERROR, "Option %s not found.\n", t->key);
+        return AVERROR_OPTION_NOT_FOUND;
+    }
+    return 0;
+}
+
+/* open a given stream. Return 0 if OK */
+int stream_component_open(VideoState *is, int stream_index)
+{
+    AVFormatContext *ic = is->ic;
+    AVCodecContext *avctx;
+    int ret;
+
+    if (stream_index < 0 || stream_index >= ic->nb_streams)
+        return -1;
+    avctx = ic->streams[stream_index]->codec;
+
+    switch(avctx->codec_type){
+        case AVMEDIA_TYPE_AUDIO   : is->last_audio_stream    = stream_index; break;
+        case AVMEDIA_TYPE_SUBTITLE: is->last_subtitle_stream = stream_index; break;
+        case AVMEDIA_TYPE_VIDEO   : is->last_video_stream    = stream_index; break;
+	default:
+	    break;
+    }
+    if ((ret = stream_open_codec(is, stream_index)) < 0)
+        return ret;
+
+    /* prepare audio output */
+    if (avctx->codec_type == AVMEDIA_TYPE_AUDIO) {
+        int audio_hw_buf_size = audio_open(is, avctx->channel_layout, avctx->channels, avctx->sample_rate, &is->audio_src);
+        if (audio_hw_buf_size < 0)
+            return -1;
+        is->audio_hw_buf_size = audio_hw_buf_size;
+        is->audio_tgt = is->audio_src;
+        audio_effects_load(is);
+        if (nb_audio_cache_streams && !is->audio_cache_tid)
+            is->audio_cache_tid = SDL_CreateThread(audio_cache_thread, is);
+    }
+
+    ic->streams[stream_index]->discard = AVDISCARD_DEFAULT;
+    switch (avctx->codec_type) {
+    case AVMEDIA_TYPE_AUDIO:
+        is->audio_stream = stream_index;
+        is->audio_st = ic->streams[stream_index];
+        is->audio_dec_st = is->audio_st;
+
+        /* init averaging filter */
+        is->audio_diff_avg_coef  = exp(log(0.01) / AUDIO_DIFF_AVG_NB);
+        is->audio_diff_avg_count = 0;
+        /* since we do not have a precise anough audio fifo fullness,
+           we correct audio sync only if larger than this threshold */
+        is->audio_diff_threshold = 2.0 * is->audio_hw_buf_size / av_samples_get_buffer_size(NULL, is->audio_tgt.channels, is->audio_tgt.freq, is->audio_tgt.fmt, 1);
+
+        memset(&is->audio_pkt, 0, sizeof(is->audio_pkt));
+        memset(&is->audio_pkt_temp, 0, sizeof(is->audio_pkt_temp));
+        packet_queue_start(&is->audioq);
+        is->audio_tid = SDL_CreateThread(audio_thread, is);
+        if (is->alsa.pcm)
+            alsa_output_start(&is->alsa, audio_rt_priority);
+        else
+            SDL_PauseAudio(0);
+        break;
+    case AVMEDIA_TYPE_VIDEO:
+        is->video_stream = stream_index;
+        is->video_st = ic->streams[stream_index];
+        is->video_dec_st = is->video_st;
+        is->video_finished = 0;
+
+        packet_queue_start(&is->videoq);
+        is->video_tid = SDL_CreateThread(video_thread, is);
+        break;
+    case AVMEDIA_TYPE_SUBTITLE:
+        is->subtitle_stream = stream_index;
+        is->subtitle_st = ic->streams[stream_index];
+        packet_queue_start(&is->subtitleq);
+
+        is->subtitle_tid = SDL_CreateThread(subtitle_thread, is);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+void stream_component_close(VideoState *is, int stream_index)
+{
+    AVFormatContext *ic = is->ic;
+    AVCodecContext *avctx;
+
+    if (stream_index < 0 || stream_index >= ic->nb_streams)
+        return;
+    avctx = ic->streams[stream_index]->codec;
+
+    switch (avctx->codec_type) {
+    case AVMEDIA_TYPE_AUDIO:
+        packet_queue_abort(&is->audioq);
+
+        if (is->alsa.pcm)
+            alsa_output_close(&is->alsa);
+        else
+            SDL_CloseAudio();
+        wakeup_signal(&is->audio_ring_wakeup);
+        SDL_WaitThread(is->audio_tid, NULL);
+        /* neither side is running, start the ring over */
+        is->audio_ring.rindex = is->audio_ring.windex = 0;
+        is->audio_drop_index = 0;
+        is->audio_clock_windex = 0;
+
+        packet_queue_flush(&is->audioq);
+        av_free_packet(&is->audio_pkt);
+        swr_free(&is->swr_ctx);
+        reclaim_buffer(&is->reclaim, &is->audio_buf1);
+        is->audio_buf1_size = 0;
+        is->audio_buf = NULL;
+        reclaim_frame(&is->reclaim, &is->frame);
+
+        if (is->rdft) {
+            av_rdft_end(is->rdft);
+            av_freep(&is->rdft_data);
+            is->rdft = NULL;
+            is->rdft_bits = 0;
+        }
+        break;
+    case AVMEDIA_TYPE_VIDEO:
+        packet_queue_abort(&is->videoq);
+
+        /* note: we also signal this mutex to make sure we deblock the
+           video thread in all cases */
+        SDL_LockMutex(is->pictq_mutex);
+        SDL_CondSignal(is->pictq_cond);
+        SDL_UnlockMutex(is->pictq_mutex);
+
+        SDL_WaitThread(is->video_tid, NULL);
+
+        packet_queue_flush(&is->videoq);
+        break;
+    case AVMEDIA_TYPE_SUBTITLE:
+        packet_queue_abort(&is->subtitleq);
+
+        /* note: we also signal this mutex to make sure we deblock the
+           video thread in all cases */
+        SDL_LockMutex(is->subpq_mutex);
+        is->subtitle_stream_changed = 1;
+
+        SDL_CondSignal(is->subpq_cond);
+        SDL_UnlockMutex(is->subpq_mutex);
+
+        SDL_WaitThread(is->subtitle_tid, NULL);
+
+        packet_queue_flush(&is->subtitleq);
+        break;
+    default:
+        break;
+    }
+
+    ic->streams[stream_index]->discard = AVDISCARD_ALL;
+    avcodec_close(avctx);
+
+    switch (avctx->codec_type) {
+    case AVMEDIA_TYPE_AUDIO:
+        /* the decoder may still have been on the stream switched away from */
+        if (is->audio_dec_st && is->audio_dec_st != is->audio_st)
+            avcodec_close(is->audio_dec_st->codec);
+        is->audio_dec_st = NULL;
+        is->audio_st = NULL;
+        is->audio_stream = -1;
+        break;
+    case AVMEDIA_TYPE_VIDEO:
+        if (is->video_dec_st && is->video_dec_st != is->video_st)
+            avcodec_close(is->video_dec_st->codec);
+        is->video_dec_st = NULL;
+        is->video_st = NULL;
+        is->video_stream = -1;
+        break;
+    case AVMEDIA_TYPE_SUBTITLE:
+        is->subtitle_st = NULL;
+        is->subtitle_stream = -1;
+        break;
+    default:
+        break;
+    }
+}
+
+static int decode_interrupt_cb(void *ctx)
+{
+    VideoState *is = ctx;
+    return is->abort_request;
+}
+
+/* start the layer from clip_time in video_stream, once the main picture at
+   start is queued. Frames queued for a previous layer are dropped. */
+static int layer_request(VideoState *is, int video_stream, int audio_stream,
+        double clip_time, int mode, double duration, double start)
+{
+    Layer *l = &is->layer;
+
+    if (!l->tid || !is->video_st || video_stream < 0 || video_stream >= is->ic->nb_streams)
+        return -1;
+    SDL_LockMutex(l->mutex);
+    l->req       = 1;
+    l->active    = 1;
+    l->eof       = 0;
+    l->stream    = video_stream;
+    l->audio_stream = l->pcm.data ? audio_stream : -1;
+    l->pcm_reset = 1;
+    l->clip_time = clip_time;
+    l->mode      = mode;
+    l->duration  = duration;
+    l->start     = start;
+    l->width     = is->video_st->codec->width;
+    l->height    = is->video_st->codec->height;
+    l->size = l->rindex = l->windex = 0;
+    SDL_CondSignal(l->cond);
+    SDL_UnlockMutex(l->mutex);
+    return 0;
+}
+
+int layer_start(VideoState *is, int video_stream, double clip_time,
+        int mode, double duration)
+{
+    return layer_request(is, video_stream, -1, clip_time, mode, duration, -INFINITY);
+}
+
+void layer_stop(VideoState *is)
+{
+    Layer *l = &is->layer;
+
+    SDL_LockMutex(l->mutex);
+    l->req    = 0;
+    l->active = 0;
+    SDL_CondSignal(l->cond);
+    SDL_UnlockMutex(l->mutex);
+}
+
+/* move one of the layer decoders onto stream, -1 to close it */
+static int layer_open_codec(AVFormatContext *ic, int *cur_stream, int stream)
+{
+    AVCodecContext *avctx;
+    AVCodec *codec;
+    AVDictionary *opts = NULL;
+    char threads[16];
+    int ret;
+
+    if (stream == *cur_stream) {
+        if (stream >= 0)
+            avcodec_flush_buffers(ic->streams[stream]->codec);
+        return 0;
+    }
+    if (*cur_stream >= 0)
+        avcodec_close(ic->streams[*cur_stream]->codec);
+    *cur_stream = -1;
+    if (stream < 0)
+        return 0;
+    avctx = ic->streams[stream]->codec;
+    if (!(codec = avcodec_find_decoder(avctx->codec_id)))
+        return -1;
+    if (avctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+        snprintf(threads, sizeof(threads), "%d", video_threads(1));
+        av_dict_set(&opts, "threads", threads, 0);
+    }
+    ret = avcodec_open2(avctx, codec, &opts);
+    av_dict_free(&opts);
+    if (ret < 0)
+        return ret;
+    *cur_stream = stream;
+    return 0;
+}
+
+/* (re)start the layer decoders on the streams asked for, at their clip time */
+static int layer_seek(VideoState *is, AVFormatContext *ic, int *video_stream,
+        int *audio_stream, int new_video, int new_audio, double clip_time)
+{
+    int64_t ts;
+    int i, ret;
+
+    if ((ret = layer_open_codec(ic, video_stream, new_video)) < 0 ||
+        (ret = layer_open_codec(ic, audio_stream, new_audio)) < 0)
+        return ret;
+    for (i = 0; i < ic->nb_streams; i++)
+        ic->streams[i]->discard = i == *video_stream || i == *audio_stream ?
+                                  AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    ts = av_rescale_q(clip_time * AV_TIME_BASE, AV_TIME_BASE_Q, ic->streams[new_video]->time_base);
+    return avformat_seek_file(ic, new_video, INT64_MIN, ts, ts, 0);
+}
+
+/* convert a decoded layer audio frame to the device format and pass it on
+   to the audio callback. Whatever does not fit the ring is dropped. */
+static void layer_queue_audio(VideoState *is, AVFrame *frame, uint8_t **buf,
+        unsigned *buf_size)
+{
+    Layer *l = &is->layer;
+    int64_t layout = (frame->channel_layout &&
+                      av_frame_get_channels(frame) == av_get_channel_layout_nb_channels(frame->channel_layout)) ?
+                     frame->channel_layout : av_get_default_channel_layout(av_frame_get_channels(frame));
+    int frame_size = is->audio_tgt.channels * av_get_bytes_per_sample(is->audio_tgt.fmt);
+    int out_count = (int64_t)frame->nb_samples * is->audio_tgt.freq / frame->sample_rate + 256;
+    AudioConvertFunc convert = NULL;
+    int n;
+
+    if (frame->sample_rate == is->audio_tgt.freq)
+        convert = audio_convert_find(frame->format, av_frame_get_channels(frame),
+                                     is->audio_tgt.fmt, is->audio_tgt.channels);
+    if (convert) {
+        av_fast_malloc(buf, buf_size, frame->nb_samples * frame_size);
+        if (!*buf)
+            return;
+        convert((int16_t *)*buf, (const uint8_t * const *)frame->extended_data,
+                frame->nb_samples, av_frame_get_channels(frame));
+        pcm_ring_write(&l->pcm, *buf, frame->nb_samples * frame_size);
+        return;
+    }
+    if (!l->swr_ctx) {
+        l->swr_ctx = swr_alloc_set_opts(NULL,
+                                        is->audio_tgt.channel_layout, is->audio_tgt.fmt, is->audio_tgt.freq,
+                                        layout, frame->format, frame->sample_rate,
+                                        0, NULL);
+        if (!l->swr_ctx || swr_init(l->swr_ctx) < 0) {
+            swr_free(&l->swr_ctx);
+            return;
+        }
+    }
+    av_fast_malloc(buf, buf_size, out_count * frame_size);
+    if (!*buf)
+        return;
+    n = swr_convert(l->swr_ctx, buf, out_count, (const uint8_t **)frame->extended_data, frame->nb_samples);
+    if (n > 0)
+        pcm_ring_write(&l->pcm, *buf, n * frame_size);
+}
+
+/* decode the layer stream ahead into its picture queue. The demuxer is
+   separate from the main one so that the layer can be at any point of the
+   file, and is opened up front so that starting a layer is only a seek. */
+static int layer_thread(void *arg)
+{
+    VideoState *is = arg;
+    Layer *l = &is->layer;
+    AVFormatContext *ic = avformat_alloc_context();
+    AVFrame *frame = avcodec_alloc_frame();
+    AVFrame *audio_frame = avcodec_alloc_frame();
+    AVPacket pkt, pkt_temp;
+    AVStream *st;
+    LayerPicture *lp;
+    int stream = -1, audio_stream = -1, got_picture, width = 0, height = 0, len;
+    double clip_time = 0, pts;
+    int64_t pts_int;
+    uint8_t *audio_buf = NULL;
+    unsigned audio_buf_size = 0;
+
+    thread_name("layer");
+    ic->interrupt_callback.callback = decode_interrupt_cb;
+    ic->interrupt_callback.opaque = is;
+    if (avformat_open_input(&ic, is->filename, is->iformat, NULL) < 0)
+        goto fail;
+    if (avformat_find_stream_info(ic, NULL) < 0)
+        goto fail;
+
+    for (;;) {
+        SDL_LockMutex(l->mutex);
+        while (!is->abort_request && !l->req &&
+               (!l->active || l->eof || l->size == LAYER_QUEUE_SIZE))
+            SDL_CondWait(l->cond, l->mutex);
+        if (is->abort_request) {
+            SDL_UnlockMutex(l->mutex);
+            break;
+        }
+        if (l->req) {
+            int new_stream = l->stream, new_audio = l->audio_stream;
+
+            l->req = 0;
+            clip_time = l->clip_time;
+            if (l->mode == LAYER_PIP) {
+                width  = l->width  / 4 & ~1;
+                height = l->height / 4 & ~1;
+            } else {
+                width  = l->width  & ~1;
+                height = l->height & ~1;
+            }
+            SDL_UnlockMutex(l->mutex);
+
+            if (new_audio != audio_stream)
+                swr_free(&l->swr_ctx);
+            if (layer_seek(is, ic, &stream, &audio_stream, new_stream, new_audio, clip_time) < 0) {
+                fprintf(stderr, "%s: could not start layer\n", is->filename);
+                SDL_LockMutex(l->mutex);
+                if (!l->req)
+                    l->active = 0;
+                SDL_UnlockMutex(l->mutex);
+            }
+            continue;
+        }
+        SDL_UnlockMutex(l->mutex);
+
+        if (av_read_frame(ic, &pkt) < 0) {
+            SDL_LockMutex(l->mutex);
+            l->eof = 1;
+            SDL_UnlockMutex(l->mutex);
+            continue;
+        }
+        if (pkt.stream_index == audio_stream) {
+            st = ic->streams[audio_stream];
+            pkt_temp = pkt;
+            while (pkt_temp.size > 0) {
+                avcodec_get_frame_defaults(audio_frame);
+                if ((len = avcodec_decode_audio4(st->codec, audio_frame, &got_picture, &pkt_temp)) < 0)
+                    break;
+                pkt_temp.data += len;
+                pkt_temp.size -= len;
+                if (got_picture && audio_frame->pkt_pts != AV_NOPTS_VALUE &&
+                    audio_frame->pkt_pts * av_q2d(st->time_base) >= clip_time - 0.001)
+                    layer_queue_audio(is, audio_frame, &audio_buf, &audio_buf_size);
+            }
+            av_free_packet(&pkt);
+            continue;
+        }
+        st = ic->streams[stream];
+        got_picture = 0;
+        if (pkt.stream_index == stream)
+            avcodec_decode_video2(st->codec, frame, &got_picture, &pkt);
+        av_free_packet(&pkt);
+        if (!got_picture)
+            continue;
+        pts_int = av_frame_get_best_effort_timestamp(frame);
+        if (pts_int == AV_NOPTS_VALUE)
+            continue;
+        /* decoding starts from the keyframe before the clip time */
+        pts = pts_int * av_q2d(st->time_base) - clip_time;
+        if (pts < -0.001)
+            continue;
+
+        /* only the decoder writes the slot at windex while the queue has room */
+        lp = &l->pictq[l->windex];
+        if (lp->width != width || lp->height != height) {
+            avpicture_free(&lp->pict);
+            lp->width = lp->height = 0;
+            if (avpicture_alloc(&lp->pict, AV_PIX_FMT_YUV420P, width, height) < 0)
+                continue;
+            lp->width  = width;
+            lp->height = height;
+        }
+        l->sws_ctx = sws_getCachedContext(l->sws_ctx, frame->width, frame->height,
+            frame->format, width, height, AV_PIX_FMT_YUV420P, sws_flags, NULL, NULL, NULL);
+        if (!l->sws_ctx)
+            continue;
+        sws_scale(l->sws_ctx, (const uint8_t **) frame->data, frame->linesize,
+                  0, frame->height, lp->pict.data, lp->pict.linesize);
+        lp->pts = pts;
+
+        SDL_LockMutex(l->mutex);
+        /* a new request came in meanwhile, this frame belongs to the old one */
+        if (!l->req) {
+            l->windex = (l->windex + 1) % LAYER_QUEUE_SIZE;
+            l->size++;
+        }
+        SDL_UnlockMutex(l->mutex);
+    }
+fail:
+    if (stream >= 0)
+        avcodec_close(ic->streams[stream]->codec);
+    if (audio_stream >= 0)
+        avcodec_close(ic->streams[audio_stream]->codec);
+    avformat_close_input(&ic);
+    avcodec_free_frame(&frame);
+    avcodec_free_frame(&audio_frame);
+    av_free(audio_buf);
+    return 0;
+}
+
+static int is_realtime(AVFormatContext *s)
+{
+    if(   !strcmp(s->iformat->name, "rtp")
+       || !strcmp(s->iformat->name, "rtsp")
+       || !strcmp(s->iformat->name, "sdp")
+    )
+        return 1;
+
+    if(s->pb && (   !strncmp(s->filename, "rtp:", 4)
+                 || !strncmp(s->filename, "udp:", 4)
+                )
+    )
+        return 1;
+    return 0;
+}
+
+/* scan the program stream layout in the background, so that startup is not
+   delayed by a full pass over the file */
+static int pack_map_thread(void *arg)
+{
+    VideoState *is = arg;
+    PackMap *map = av_mallocz(sizeof(PackMap));
+
+    thread_name("pack map");
+    if (!map)
+        return 0;
+    if (packmap_build(map, is->filename, &is->abort_request) < 0) {
+        av_free(map);
+        return 0;
+    }
+    SDL_LockMutex(is->pack_map_mutex);
+    is->pack_map = map;
+    SDL_UnlockMutex(is->pack_map_mutex);
+    return 0;
+}
+
+static uint64_t active_stream_mask(VideoState *is)
+{
+    uint64_t mask = 0;
+
+    if (is->audio_stream >= 0 && is->audio_stream < 64)
+        mask |= UINT64_C(1) << is->audio_stream;
+    if (is->video_stream >= 0 && is->video_stream < 64)
+        mask |= UINT64_C(1) << is->video_stream;
+    if (is->subtitle_stream >= 0 && is->subtitle_stream < 64)
+        mask |= UINT64_C(1) << is->subtitle_stream;
+    return mask;
+}
+
+/* jump over the runs of packs that only hold streams we are not playing */
+static void pack_skip_inactive(VideoState *is, PackMap *map)
+{
+    uint64_t mask = active_stream_mask(is);
+    int64_t pos, next;
+
+    if (!mask)
+        return;
+    pos = avio_tell(is->ic->pb);
+    next = packmap_next(map, pos, mask);
+    if (next > pos && avio_seek(is->ic->pb, next, SEEK_SET) >= 0)
+        is->bytes_skipped += next - pos;
+}
+
+/* whether pkt is the last one of its stream in decoding order: its dts
+   reaches the end lavf estimated from the timestamps of the program stream */
+static int packet_ends_stream(AVStream *st, AVPacket *pkt)
+{
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+
+    if (ts == AV_NOPTS_VALUE || st->start_time == AV_NOPTS_VALUE || st->duration <= 0)
+        return 0;
+    return ts + pkt->duration >= st->start_time + st->duration;
+}
+
+/* The clips of a program stream are muxed side by side, so the one being
+   played ends long before the file does. It has been read out once every
+   active stream has delivered its last packet, or with the pack map, once
+   the reader is past the last PES of each of them. */
+static int clip_read_out(VideoState *is, PackMap *map, uint64_t ended)
+{
+    int streams[2] = { is->video_stream, is->audio_stream };
+    int64_t pos = avio_tell(is->ic->pb), end;
+    int i, nb_streams = 0;
+
+    for (i = 0; i < 2; i++) {
+        if (streams[i] < 0)
+            continue;
+        if (streams[i] >= 64)
+            return 0;
+        nb_streams++;
+        if (ended & (UINT64_C(1) << streams[i]))
+            continue;
+        if (!map || (end = packmap_stream_end(map, streams[i])) < 0 || pos < end)
+            return 0;
+    }
+    return nb_streams > 0;
+}
+
+/* duration of a packet in AV_TIME_BASE units, one frame if the demuxer
+   does not know it */
+static int64_t packet_duration(AVStream *st, AVPacket *pkt)
+{
+    if (pkt->duration)
+        return av_rescale_q(pkt->duration, st->time_base, AV_TIME_BASE_Q);
+    if (st->r_frame_rate.num)
+        return av_rescale_q(1, (AVRational){ st->r_frame_rate.den, st->r_frame_rate.num }, AV_TIME_BASE_Q);
+    return 0;
+}
+
+static void loop_cache_release(LoopCacheHold *h)
+{
+    if (!__sync_sub_and_fetch(&h->refs, 1)) {
+        reclaim_packets(h->reclaim, h->pkts);
+        av_free(h);
+    }
+}
+
+/* AVPacket.destruct of a replayed packet, which only borrows its payload */
+static void loop_cache_packet_destruct(AVPacket *pkt)
+{
+    loop_cache_release(pkt->priv);
+    pkt->data = NULL;
+    pkt->size = 0;
+}
+
+static void loop_cache_free_packets(VideoState *is)
+{
+    LoopCache *c = &is->loop_cache;
+
+    if (c->hold) {
+        loop_cache_release(c->hold);
+        c->hold = NULL;
+    } else {
+        reclaim_packets(&is->reclaim, c->first_pkt);
+    }
+    c->first_pkt = NULL;
+    c->last_pkt = NULL;
+    c->next_pkt = NULL;
+    c->size = 0;
+}
+
+static void loop_cache_reset(VideoState *is)
+{
+    LoopCache *c = &is->loop_cache;
+
+    loop_cache_free_packets(is);
+    memset(c, 0, sizeof(*c));
+    c->video_stream = -1;
+    c->audio_stream = -1;
+}
+
+static int loop_cache_matches(VideoState *is)
+{
+    return is->loop_cache.video_stream == is->video_stream &&
+           is->loop_cache.audio_stream == is->audio_stream;
+}
+
+/* start caching the clip entered at pos */
+static void loop_cache_start(VideoState *is, int64_t pos, int seek_by_bytes)
+{
+    LoopCache *c = &is->loop_cache;
+
+    /* a clip which did not fit once will not fit the next time either */
+    if (!(c->overflow && loop_cache_matches(is))) {
+        loop_cache_reset(is);
+        c->video_stream = is->video_stream;
+        c->audio_stream = is->audio_stream;
+        c->start_pts = INT64_MAX;
+        c->end_pts   = INT64_MIN;
+        c->recording = 1;
+    }
+    c->seek_pos      = pos;
+    c->seek_by_bytes = seek_by_bytes;
+}
+
+static void loop_cache_add(VideoState *is, AVPacket *pkt)
+{
+    LoopCache *c = &is->loop_cache;
+    MyAVPacketList *pkt1;
+    AVStream *st;
+    int ref_stream;
+
+    if (!c->recording ||
+        (pkt->stream_index != c->video_stream && pkt->stream_index != c->audio_stream))
+        return;
+
+    pkt1 = NULL;
+    if (!loop_cache_matches(is) || c->size + pkt->size > loop_cache_budget ||
+        !(pkt1 = av_malloc(sizeof(MyAVPacketList))) || av_copy_packet(&pkt1->pkt, pkt) < 0) {
+        av_free(pkt1);
+        loop_cache_free_packets(is);
+        c->recording = 0;
+        c->overflow  = 1;
+        return;
+    }
+    pkt1->next   = NULL;
+    pkt1->serial = 0;
+    if (!c->last_pkt)
+        c->first_pkt = pkt1;
+    else
+        c->last_pkt->next = pkt1;
+    c->last_pkt = pkt1;
+    c->size += pkt->size;
+
+    /* the loop period is the span of the video, or of the audio without video */
+    ref_stream = c->video_stream >= 0 ? c->video_stream : c->audio_stream;
+    if (pkt->stream_index == ref_stream && pkt->pts != AV_NOPTS_VALUE) {
+        int64_t pts;
+
+        st = is->ic->streams[pkt->stream_index];
+        pts = av_rescale_q(pkt->pts, st->time_base, AV_TIME_BASE_Q);
+        c->start_pts = FFMIN(c->start_pts, pts);
+        c->end_pts   = FFMAX(c->end_pts, pts + packet_duration(st, pkt));
+    }
+}
+
+/* at the end of the clip: start (another) pass over the cached packets.
+   Returns 1 if the reader should now take its packets from the cache. */
+static int loop_cache_replay(VideoState *is)
+{
+    LoopCache *c = &is->loop_cache;
+
+    /* a pending switch takes over at the end of the pass */
+    if (!is->loop_req || !loop_cache_matches(is) || is->switch_req)
+        return 0;
+    if (c->recording) {
+        c->recording = 0;
+        c->complete  = c->first_pkt && c->end_pts > c->start_pts;
+    }
+    if (c->complete && !c->hold) {
+        if (!(c->hold = av_mallocz(sizeof(*c->hold)))) {
+            c->complete = 0;
+            return 0;
         }
+        c->hold->refs    = 1;
+        c->hold->pkts    = c->first_pkt;
+        c->hold->reclaim = &is->reclaim;
     }
-
-    audio_hw_params->fmt = AV_SAMPLE_FMT_S16;
-    audio_hw_params->freq = spec.freq;
-    audio_hw_params->channel_layout = wanted_channel_layout;
-    audio_hw_params->channels =  spec.channels;
-    return spec.size;
+    if (!c->complete)
+        return 0;
+    c->loops++;
+    c->next_pkt = c->first_pkt;
+    return 1;
 }
 
-/* open a given stream. Return 0 if OK */
-int stream_component_open(VideoState *is, int stream_index)
+/* copy out the next cached packet, its timestamps moved on by the loops
+   already played so that the decoders and clocks see one continuous clip */
+static int loop_cache_get(VideoState *is, AVPacket *pkt)
 {
-    AVFormatContext *ic = is->ic;
-    AVCodecContext *avctx;
-    AVCodec *codec;
-    const char *forced_codec_name = NULL;
-    AVDictionary *opts;
-    AVDictionaryEntry *t = NULL;
+    LoopCache *c = &is->loop_cache;
+    MyAVPacketList *pkt1 = c->next_pkt;
+    AVStream *st;
+    int64_t offset;
+
+    c->next_pkt = pkt1->next;
+    st = is->ic->streams[pkt1->pkt.stream_index];
+    /* every stream loops on the span of the video, audio running on past
+       it would overlap the next pass and push the sound later each time.
+       Audio ending short leaves a gap the audio clock steps over. */
+    if (pkt1->pkt.stream_index == c->audio_stream && c->video_stream >= 0 &&
+        pkt1->pkt.pts != AV_NOPTS_VALUE &&
+        av_rescale_q(pkt1->pkt.pts, st->time_base, AV_TIME_BASE_Q) >= c->end_pts)
+        return AVERROR(EAGAIN);
+    /* the payload is lent out, not copied; side data, which av_free_packet()
+       frees whatever the destruct, still needs a copy of its own */
+    if (pkt1->pkt.side_data_elems) {
+        if (av_copy_packet(pkt, &pkt1->pkt) < 0)
+            return AVERROR(ENOMEM);
+    } else {
+        *pkt = pkt1->pkt;
+        pkt->destruct = loop_cache_packet_destruct;
+        pkt->priv     = c->hold;
+        __sync_fetch_and_add(&c->hold->refs, 1);
+    }
+    offset = av_rescale_q(c->loops * (c->end_pts - c->start_pts), AV_TIME_BASE_Q, st->time_base);
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts += offset;
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts += offset;
+    return 0;
+}
 
-    if (stream_index < 0 || stream_index >= ic->nb_streams)
-        return -1;
-    avctx = ic->streams[stream_index]->codec;
+void stream_set_loop(VideoState *is, int loop_clip)
+{
+    is->loop_req = loop_clip;
+    wakeup_signal(&is->read_wakeup);
+}
 
-    codec = avcodec_find_decoder(avctx->codec_id);
+/* append a segment to the timeline, timer_mutex held */
+static void segment_start(VideoState *is, int id, int64_t offset, double start)
+{
+    Segment *seg;
 
-    switch(avctx->codec_type){
-        case AVMEDIA_TYPE_AUDIO   : is->last_audio_stream    = stream_index; forced_codec_name =    audio_codec_name; break;
-        case AVMEDIA_TYPE_SUBTITLE: is->last_subtitle_stream = stream_index; forced_codec_name = subtitle_codec_name; break;
-        case AVMEDIA_TYPE_VIDEO   : is->last_video_stream    = stream_index; forced_codec_name =    video_codec_name; break;
-	default:
-	    break;
-    }
-    if (forced_codec_name)
-        codec = avcodec_find_decoder_by_name(forced_codec_name);
-    if (!codec) {
-        if (forced_codec_name) fprintf(stderr, "No codec could be found with name '%s'\n", forced_codec_name);
-        else                   fprintf(stderr, "No codec could be found with id %d\n", avctx->codec_id);
-        return -1;
+    if (is->nb_segments == SEGMENT_NB) {
+        memmove(is->segments, is->segments + 1, (SEGMENT_NB - 1) * sizeof(*seg));
+        is->nb_segments--;
     }
+    seg = &is->segments[is->nb_segments++];
+    seg->id     = id;
+    seg->offset = offset;
+    seg->start  = start;
+    is->segment_id = id;
+}
 
-    avctx->codec_id = codec->id;
-    avctx->workaround_bugs   = workaround_bugs;
-    avctx->lowres            = lowres;
-    if(avctx->lowres > codec->max_lowres){
-        av_log(avctx, AV_LOG_WARNING, "The maximum value for lowres supported by the decoder is %d\n",
-                codec->max_lowres);
-        avctx->lowres= codec->max_lowres;
-    }
-    avctx->idct_algo         = idct;
-    avctx->skip_frame        = skip_frame;
-    avctx->skip_idct         = skip_idct;
-    avctx->skip_loop_filter  = skip_loop_filter;
-    avctx->error_concealment = error_concealment;
+/* forget the timeline after a flush: what follows is the current clip
+   again, at its own timestamps */
+static void segment_reset(VideoState *is)
+{
+    SDL_LockMutex(is->timer_mutex);
+    is->nb_segments = 0;
+    segment_start(is, is->segment_id, 0, -INFINITY);
+    SDL_UnlockMutex(is->timer_mutex);
+    is->ts_offset = 0;
+    is->queued_end_pts = AV_NOPTS_VALUE;
+    is->read_eof = 0;
+}
 
-    if(avctx->lowres) avctx->flags |= CODEC_FLAG_EMU_EDGE;
-    if (fast)   avctx->flags2 |= CODEC_FLAG2_FAST;
-    if(codec->capabilities & CODEC_CAP_DR1)
-        avctx->flags |= CODEC_FLAG_EMU_EDGE;
+/* move a packet of the current clip onto the timeline and note where the
+   queued media ends */
+static void segment_rebase_packet(VideoState *is, AVPacket *pkt)
+{
+    AVStream *st = is->ic->streams[pkt->stream_index];
+    int ref_stream = is->video_stream >= 0 ? is->video_stream : is->audio_stream;
+    int64_t offset, end;
 
-    opts = filter_codec_opts(codec_opts, avctx->codec_id, ic, ic->streams[stream_index], codec);
-    if (!av_dict_get(opts, "threads", NULL, 0))
-        av_dict_set(&opts, "threads", "auto", 0);
-    if (avcodec_open2(avctx, codec, &opts) < 0)
-        return -1;
-    if ((t = av_dict_get(opts, "", NULL, AV_DICT_IGNORE_SUFFIX))) {
-        av_log(NULL, AV_LOG_ERROR, "Option %s not found.\n", t->key);
-        return AVERROR_OPTION_NOT_FOUND;
+    if (is->ts_offset) {
+        offset = av_rescale_q(is->ts_offset, AV_TIME_BASE_Q, st->time_base);
+        if (pkt->pts != AV_NOPTS_VALUE)
+            pkt->pts += offset;
+        if (pkt->dts != AV_NOPTS_VALUE)
+            pkt->dts += offset;
     }
-
-    /* prepare audio output */
-    if (avctx->codec_type == AVMEDIA_TYPE_AUDIO) {
-        int audio_hw_buf_size = audio_open(is, avctx->channel_layout, avctx->channels, avctx->sample_rate, &is->audio_src);
-        if (audio_hw_buf_size < 0)
-            return -1;
-        is->audio_hw_buf_size = audio_hw_buf_size;
-        is->audio_tgt = is->audio_src;
+    if (pkt->stream_index == ref_stream && pkt->pts != AV_NOPTS_VALUE) {
+        end = av_rescale_q(pkt->pts, st->time_base, AV_TIME_BASE_Q) + packet_duration(st, pkt);
+        if (is->queued_end_pts == AV_NOPTS_VALUE || end > is->queued_end_pts)
+            is->queued_end_pts = end;
     }
+}
 
-    ic->streams[stream_index]->discard = AVDISCARD_DEFAULT;
-    switch (avctx->codec_type) {
-    case AVMEDIA_TYPE_AUDIO:
-        is->audio_stream = stream_index;
-        is->audio_st = ic->streams[stream_index];
-        is->audio_buf_size  = 0;
-        is->audio_buf_index = 0;
-
-        /* init averaging filter */
-        is->audio_diff_avg_coef  = exp(log(0.01) / AUDIO_DIFF_AVG_NB);
-        is->audio_diff_avg_count = 0;
-        /* since we do not have a precise anough audio fifo fullness,
-           we correct audio sync only if larger than this threshold */
-        is->audio_diff_threshold = 2.0 * is->audio_hw_buf_size / av_samples_get_buffer_size(NULL, is->audio_tgt.channels, is->audio_tgt.freq, is->audio_tgt.fmt, 1);
+static void media_timer_link(VideoState *is, MediaTimer *t)
+{
+    MediaTimer **list;
 
-        memset(&is->audio_pkt, 0, sizeof(is->audio_pkt));
-        memset(&is->audio_pkt_temp, 0, sizeof(is->audio_pkt_temp));
-        packet_queue_start(&is->audioq);
-        SDL_PauseAudio(0);
-        break;
-    case AVMEDIA_TYPE_VIDEO:
-        is->video_stream = stream_index;
-        is->video_st = ic->streams[stream_index];
+    if (isinf(t->pts))
+        list = &is->timer_eos;
+    else
+        list = &is->timer_wheel[(int64_t)floor(t->pts / MEDIA_TIMER_TICK) & (MEDIA_TIMER_SLOTS - 1)];
+    t->next = *list;
+    *list = t;
+}
 
-        packet_queue_start(&is->videoq);
-        is->video_tid = SDL_CreateThread(video_thread, is);
-        break;
-    case AVMEDIA_TYPE_SUBTITLE:
-        is->subtitle_stream = stream_index;
-        is->subtitle_st = ic->streams[stream_index];
-        packet_queue_start(&is->subtitleq);
+/* call cb once the frame at clip time pts of the given segment is being
+   presented, just before it is displayed. The callback runs on the event
+   loop thread and must not block. */
+int media_timer_add(VideoState *is, int segment, double pts,
+        MediaTimerCallback cb, void *opaque)
+{
+    MediaTimer *t;
 
-        is->subtitle_tid = SDL_CreateThread(subtitle_thread, is);
-        break;
-    default:
-        break;
+    SDL_LockMutex(is->timer_mutex);
+    t = is->timer_free;
+    if (!t) {
+        SDL_UnlockMutex(is->timer_mutex);
+        return AVERROR(ENOMEM);
     }
+    is->timer_free = t->next;
+    t->segment = segment;
+    t->pts     = pts;
+    t->cb      = cb;
+    t->opaque  = opaque;
+    media_timer_link(is, t);
+    /* the slot may be behind the wheel already */
+    is->timer_rescan = 1;
+    SDL_UnlockMutex(is->timer_mutex);
     return 0;
 }
 
-void stream_component_close(VideoState *is, int stream_index)
+static void media_timers_cancel(VideoState *is, int segment)
 {
-    AVFormatContext *ic = is->ic;
-    AVCodecContext *avctx;
-
-    if (stream_index < 0 || stream_index >= ic->nb_streams)
-        return;
-    avctx = ic->streams[stream_index]->codec;
-
-    switch (avctx->codec_type) {
-    case AVMEDIA_TYPE_AUDIO:
-        packet_queue_abort(&is->audioq);
+    MediaTimer **list, *t;
+    int i;
 
-        SDL_CloseAudio();
+    SDL_LockMutex(is->timer_mutex);
+    for (i = 0; i <= MEDIA_TIMER_SLOTS; i++) {
+        list = i < MEDIA_TIMER_SLOTS ? &is->timer_wheel[i] : &is->timer_eos;
+        while ((t = *list)) {
+            if (t->segment == segment) {
+                *list = t->next;
+                t->next = is->timer_free;
+                is->timer_free = t;
+            } else {
+                list = &t->next;
+            }
+        }
+    }
+    SDL_UnlockMutex(is->timer_mutex);
+}
 
-        packet_queue_flush(&is->audioq);
-        av_free_packet(&is->audio_pkt);
-        swr_free(&is->swr_ctx);
-        av_freep(&is->audio_buf1);
-        is->audio_buf1_size = 0;
-        is->audio_buf = NULL;
-        avcodec_free_frame(&is->frame);
+/* unlink the timers of a list which are due at clip_time into fired[],
+   timer_mutex held */
+static int media_timers_collect(VideoState *is, MediaTimer **list,
+        double clip_time, MediaTimer *fired, int nb_fired)
+{
+    MediaTimer *t;
+
+    while ((t = *list)) {
+        if (t->segment < is->timer_segment ||
+            (t->segment == is->timer_segment && t->pts <= clip_time)) {
+            *list = t->next;
+            fired[nb_fired++] = *t;
+            t->next = is->timer_free;
+            is->timer_free = t;
+        } else {
+            list = &t->next;
+        }
+    }
+    return nb_fired;
+}
 
-        if (is->rdft) {
-            av_rdft_end(is->rdft);
-            av_freep(&is->rdft_data);
-            is->rdft = NULL;
-            is->rdft_bits = 0;
+/* run the timers due now that the frame at pts is on screen, or all those
+   of the segments presented so far once the media has played out */
+static void media_timers_update(VideoState *is, double pts, int at_end)
+{
+    MediaTimer fired[MEDIA_TIMER_NB];
+    Segment *seg = NULL;
+    double clip_time = INFINITY;
+    int64_t tick, t;
+    int i, nb_fired = 0, full;
+
+    SDL_LockMutex(is->timer_mutex);
+    if (!at_end) {
+        /* the segments are in presentation order */
+        for (i = 0; i < is->nb_segments; i++)
+            if (is->segments[i].start <= pts + 0.001)
+                seg = &is->segments[i];
+        if (!seg) {
+            SDL_UnlockMutex(is->timer_mutex);
+            return;
         }
-        break;
-    case AVMEDIA_TYPE_VIDEO:
-        packet_queue_abort(&is->videoq);
+        clip_time = pts - seg->offset / (double)AV_TIME_BASE;
+    }
+    tick = at_end ? is->timer_tick : (int64_t)floor(clip_time / MEDIA_TIMER_TICK);
+    full = at_end || is->timer_rescan || seg->id != is->timer_segment ||
+           tick < is->timer_tick || tick - is->timer_tick >= MEDIA_TIMER_SLOTS;
+    if (seg)
+        is->timer_segment = seg->id;
+    if (full) {
+        /* new segment, jump or new timers: look at every slot */
+        for (i = 0; i < MEDIA_TIMER_SLOTS; i++)
+            nb_fired = media_timers_collect(is, &is->timer_wheel[i], clip_time, fired, nb_fired);
+        nb_fired = media_timers_collect(is, &is->timer_eos, clip_time, fired, nb_fired);
+        is->timer_rescan = 0;
+    } else {
+        for (t = is->timer_tick; t <= tick; t++)
+            nb_fired = media_timers_collect(is, &is->timer_wheel[t & (MEDIA_TIMER_SLOTS - 1)],
+                                            clip_time, fired, nb_fired);
+    }
+    is->timer_tick = tick;
+    SDL_UnlockMutex(is->timer_mutex);
 
-        /* note: we also signal this mutex to make sure we deblock the
-           video thread in all cases */
-        SDL_LockMutex(is->pictq_mutex);
-        SDL_CondSignal(is->pictq_cond);
-        SDL_UnlockMutex(is->pictq_mutex);
+    /* the timers are back in the pool, so callbacks may add new ones */
+    for (i = 0; i < nb_fired; i++)
+        fired[i].cb(is, fired[i].opaque);
+}
 
-        SDL_WaitThread(is->video_tid, NULL);
+/* hand a stream of the clip over to stream_index */
+static int stream_switch_component(VideoState *is, int old_index, int stream_index)
+{
+    AVFormatContext *ic = is->ic;
+    AVStream *st;
+    int ret;
 
-        packet_queue_flush(&is->videoq);
-        break;
-    case AVMEDIA_TYPE_SUBTITLE:
-        packet_queue_abort(&is->subtitleq);
+    if (stream_index == old_index)
+        return 0;
+    if (old_index < 0 || stream_index < 0) {
+        /* nothing to hand over, start or stop the decoder */
+        stream_component_close(is, old_index);
+        return stream_index < 0 ? 0 : stream_component_open(is, stream_index);
+    }
+    st = ic->streams[stream_index];
+    SDL_LockMutex(is->switch_mutex);
+    ret = avcodec_is_open(st->codec) ? 0 : stream_open_codec(is, stream_index);
+    SDL_UnlockMutex(is->switch_mutex);
+    if (ret < 0)
+        return ret;
 
-        /* note: we also signal this mutex to make sure we deblock the
-           video thread in all cases */
-        SDL_LockMutex(is->subpq_mutex);
-        is->subtitle_stream_changed = 1;
+    ic->streams[old_index]->discard = AVDISCARD_ALL;
+    st->discard = AVDISCARD_DEFAULT;
+    if (st->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+        is->video_stream = is->last_video_stream = stream_index;
+        is->video_st = st;
+    } else {
+        is->audio_stream = is->last_audio_stream = stream_index;
+        is->audio_st = st;
+    }
+    return 0;
+}
 
-        SDL_CondSignal(is->subpq_cond);
-        SDL_UnlockMutex(is->subpq_mutex);
+/* join the clip requested by stream_switch() onto the end of what has been
+   queued. The queues are not flushed: the decoders follow the stream change
+   packet by packet, so the last frame of the old clip and the first of the
+   new one are presented back to back. */
+static void stream_switch_execute(VideoState *is)
+{
+    AVFormatContext *ic = is->ic;
+    LoopCache *c = &is->loop_cache;
+    AVStream *ref_st;
+    int video_stream, audio_stream, flags, segment, ret, fade_stream = -1, fade_audio = -1;
+    int64_t pos, clip_start = 0, fade_time = 0;
+
+    SDL_LockMutex(is->switch_mutex);
+    video_stream = is->switch_video_stream;
+    audio_stream = is->switch_audio_stream;
+    pos     = is->switch_pos;
+    flags   = is->switch_flags;
+    segment = is->switch_segment;
+    is->switch_req = 0;
+    SDL_UnlockMutex(is->switch_mutex);
+
+    /* the old clip carries on from where it was left, as a layer fading out */
+    if ((flags & SWITCH_CROSSFADE) && is->video_stream >= 0 &&
+        is->queued_end_pts != AV_NOPTS_VALUE) {
+        fade_stream = is->video_stream;
+        fade_audio  = is->audio_stream;
+        fade_time   = is->queued_end_pts - is->ts_offset;
+        if (c->next_pkt && c->end_pts > c->start_pts)
+            fade_time = c->start_pts + (fade_time - c->start_pts) % (c->end_pts - c->start_pts);
+    }
 
-        SDL_WaitThread(is->subtitle_tid, NULL);
+    if (stream_switch_component(is, is->video_stream, video_stream) < 0 ||
+        stream_switch_component(is, is->audio_stream, audio_stream) < 0)
+        fprintf(stderr, "%s: could not switch streams\n", ic->filename);
 
-        packet_queue_flush(&is->subtitleq);
-        break;
-    default:
-        break;
+    is->loop_req = !!(flags & SWITCH_LOOP);
+    c->next_pkt = NULL;
+    if (is->loop_req && c->complete && loop_cache_matches(is)) {
+        c->loops    = 0;
+        c->next_pkt = c->first_pkt;
+        clip_start  = c->start_pts;
+    } else {
+        if (pos >= 0)
+            ret = avformat_seek_file(ic, -1, INT64_MIN, pos, INT64_MAX, AVSEEK_FLAG_BYTE);
+        else
+            ret = avformat_seek_file(ic, -1, INT64_MIN, 0, INT64_MAX, 0);
+        if (ret < 0)
+            fprintf(stderr, "%s: error while seeking\n", ic->filename);
+        if (is->loop_req)
+            loop_cache_start(is, FFMAX(pos, 0), pos >= 0);
+        else
+            c->recording = 0;
+        ref_st = is->video_st ? is->video_st : is->audio_st;
+        if (ref_st && ref_st->start_time != AV_NOPTS_VALUE)
+            clip_start = av_rescale_q(ref_st->start_time, ref_st->time_base, AV_TIME_BASE_Q);
     }
 
-    ic->streams[stream_index]->discard = AVDISCARD_ALL;
-    avcodec_close(avctx);
+    is->ts_offset = is->queued_end_pts != AV_NOPTS_VALUE ? is->queued_end_pts - clip_start : 0;
+    is->read_eof  = 0;
+    SDL_LockMutex(is->timer_mutex);
+    segment_start(is, segment, is->ts_offset,
+                  (clip_start + is->ts_offset) / (double)AV_TIME_BASE);
+    SDL_UnlockMutex(is->timer_mutex);
 
-    switch (avctx->codec_type) {
-    case AVMEDIA_TYPE_AUDIO:
-        is->audio_st = NULL;
-        is->audio_stream = -1;
-        break;
-    case AVMEDIA_TYPE_VIDEO:
-        is->video_st = NULL;
-        is->video_stream = -1;
-        break;
-    case AVMEDIA_TYPE_SUBTITLE:
-        is->subtitle_st = NULL;
-        is->subtitle_stream = -1;
-        break;
-    default:
-        break;
-    }
+    if (fade_stream >= 0)
+        layer_request(is, fade_stream, fade_audio, fade_time / (double)AV_TIME_BASE, LAYER_FADE_OUT,
+                      crossfade_duration, (clip_start + is->ts_offset) / (double)AV_TIME_BASE);
 }
 
-static int decode_interrupt_cb(void *ctx)
+/* Play video_stream/audio_stream from byte offset pos (from the start of the
+ * file if pos < 0) once the current clip has been read out (SWITCH_AT_END)
+ * or straight away. Returns the id of the segment the clip will play as,
+ * for media_timer_add(). A switch still pending is replaced. */
+int stream_switch(VideoState *is, int video_stream, int audio_stream,
+        int64_t pos, int flags)
 {
-    VideoState *is = ctx;
-    return is->abort_request;
+    int segment;
+
+    SDL_LockMutex(is->switch_mutex);
+    if (is->switch_req)
+        media_timers_cancel(is, is->switch_segment);
+    segment = is->switch_segment = ++is->next_segment_id;
+    is->switch_video_stream = video_stream;
+    is->switch_audio_stream = audio_stream;
+    is->switch_pos   = pos;
+    is->switch_flags = flags;
+    is->switch_req   = 1;
+    SDL_UnlockMutex(is->switch_mutex);
+    wakeup_signal(&is->read_wakeup);
+    return segment;
 }
 
-static int is_realtime(AVFormatContext *s)
+/* whether q holds its target duration divided by scale, or if its packets
+   carry no durations, MIN_FRAMES / scale packets */
+static int queue_has_enough(PacketQueue *q, int stream, int scale)
 {
-    if(   !strcmp(s->iformat->name, "rtp")
-       || !strcmp(s->iformat->name, "rtsp")
-       || !strcmp(s->iformat->name, "sdp")
-    )
+    if (stream < 0 || q->abort_request)
         return 1;
+    if (q->target > 0 && q->duration > 0)
+        return q->duration > q->target / scale;
+    return q->nb_packets > MIN_FRAMES / scale;
+}
 
-    if(s->pb && (   !strncmp(s->filename, "rtp:", 4)
-                 || !strncmp(s->filename, "udp:", 4)
-                )
-    )
-        return 1;
-    return 0;
+/* whether the reader has enough queued: above size bytes in all, or every
+   queue at its high (scale 1) or low (scale 2) mark */
+static int queues_full(VideoState *is, int size, int scale)
+{
+    return is->audioq.size + is->videoq.size + is->subtitleq.size > size
+        || (   queue_has_enough(&is->audioq,    is->audio_stream,    scale)
+            && queue_has_enough(&is->videoq,    is->video_stream,    scale)
+            && queue_has_enough(&is->subtitleq, is->subtitle_stream, scale));
 }
 
 /* this thread gets the stream from the disk or the network */
@@ -2156,8 +4470,14 @@ static int read_thread(void *arg)
     AVDictionaryEntry *t;
     AVDictionary **opts;
     int orig_nb_streams;
-    SDL_mutex *wait_mutex = SDL_CreateMutex();
-
+    int64_t read_pos;
+    int loop_hit;
+    PackMap *pack_map = NULL;
+    uint64_t streams_ended = 0;
+    int full = 0, end_queued = 0;
+    int64_t start;
+
+    thread_name("read");
     memset(st_index, -1, sizeof(st_index));
     is->last_video_stream = is->video_stream = -1;
     is->last_audio_stream = is->audio_stream = -1;
@@ -2166,6 +4486,11 @@ static int read_thread(void *arg)
     ic = avformat_alloc_context();
     ic->interrupt_callback.callback = decode_interrupt_cb;
     ic->interrupt_callback.opaque = is;
+    if (io_prefetch_kb > 0 && !strstr(is->filename, "://") &&
+        (is->prefetch_pb = prefetch_open(is->filename, io_prefetch_kb * 1024, io_block_kb * 1024))) {
+        ic->pb = is->prefetch_pb;
+        ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
     err = avformat_open_input(&ic, is->filename, is->iformat, &format_opts);
     if (err < 0) {
         print_error(is->filename, err);
@@ -2220,6 +4545,11 @@ static int read_thread(void *arg)
 
     is->realtime = is_realtime(ic);
 
+    /* the map also tells where each clip ends, so it is built even when
+       nothing is to be skipped */
+    if (!is->realtime && ic->pb && !strcmp(ic->iformat->name, "mpeg"))
+        is->pack_map_tid = SDL_CreateThread(pack_map_thread, is);
+
     for (i = 0; i < ic->nb_streams; i++)
         ic->streams[i]->discard = AVDISCARD_ALL;
     if (!video_disable)
@@ -2268,6 +4598,12 @@ static int read_thread(void *arg)
         goto fail;
     }
 
+    if (is->loop_req)
+        loop_cache_start(is, start_time != AV_NOPTS_VALUE ? start_time : 0, 0);
+
+    if (layer_enable && !is->realtime && ic->pb)
+        is->layer.tid = SDL_CreateThread(layer_thread, is);
+
     if (infinite_buffer < 0 && is->realtime)
         infinite_buffer = 1;
 
@@ -2298,7 +4634,12 @@ static int read_thread(void *arg)
 // FIXME the +-2 is due to rounding being not done in the correct direction in generation
 //      of the seek_pos/seek_rel variables
 
-            ret = avformat_seek_file(is->ic, -1, seek_min, seek_target, seek_max, is->seek_flags);
+            /* a cached clip restarts from memory, the file position does not matter */
+            loop_hit = is->loop_req && is->loop_cache.complete && loop_cache_matches(is);
+            if (loop_hit)
+                ret = 0;
+            else
+                ret = avformat_seek_file(is->ic, -1, seek_min, seek_target, seek_max, is->seek_flags);
             if (ret < 0) {
                 fprintf(stderr, "%s: error while seeking\n", is->ic->filename);
             } else {
@@ -2319,38 +4660,61 @@ static int read_thread(void *arg)
                 } else {
                    update_external_clock_pts(is, seek_target / (double)AV_TIME_BASE);
                 }
+                segment_reset(is);
+                if (loop_hit) {
+                    is->loop_cache.loops    = 0;
+                    is->loop_cache.next_pkt = is->loop_cache.first_pkt;
+                } else {
+                    is->loop_cache.next_pkt = NULL;
+                    if (is->loop_req)
+                        loop_cache_start(is, seek_target, !!(is->seek_flags & AVSEEK_FLAG_BYTE));
+                    else
+                        is->loop_cache.recording = 0;
+                }
             }
             is->seek_req = 0;
             eof = 0;
+            end_queued = 0;
+            streams_ended = 0;
             if (is->paused)
                 step_to_next_frame(is);
         }
+        if (is->switch_req && (eof || !(is->switch_flags & SWITCH_AT_END))) {
+            stream_switch_execute(is);
+            eof = 0;
+            end_queued = 0;
+            streams_ended = 0;
+        }
         if (is->queue_attachments_req) {
             avformat_queue_attached_pictures(ic);
             is->queue_attachments_req = 0;
         }
 
-        /* if the queue are full, no need to read more */
+        /* if the queue are full, no need to read more until the decoders
+           have taken them down to the low marks */
         if (infinite_buffer<1 &&
-              (is->audioq.size + is->videoq.size + is->subtitleq.size > MAX_QUEUE_SIZE
-            || (   (is->audioq   .nb_packets > MIN_FRAMES || is->audio_stream < 0 || is->audioq.abort_request)
-                && (is->videoq   .nb_packets > MIN_FRAMES || is->video_stream < 0 || is->videoq.abort_request)
-                && (is->subtitleq.nb_packets > MIN_FRAMES || is->subtitle_stream < 0 || is->subtitleq.abort_request)))) {
-            /* wait 10 ms */
-            SDL_LockMutex(wait_mutex);
-            SDL_CondWaitTimeout(is->continue_read_thread, wait_mutex, 10);
-            SDL_UnlockMutex(wait_mutex);
+            (full ? queues_full(is, LOW_QUEUE_SIZE, 2)
+                  : queues_full(is, MAX_QUEUE_SIZE, 1))) {
+            full = 1;
+            wakeup_wait(&is->read_wakeup, 0);
             continue;
         }
+        full = 0;
         if (eof) {
-            if (is->video_stream >= 0) {
+            if (loop_cache_replay(is)) {
+                eof = 0;
+                continue;
+            }
+            is->read_eof = 1;
+            mclock_virtual_kick();
+            if (!end_queued && is->video_stream >= 0) {
                 av_init_packet(pkt);
                 pkt->data = NULL;
                 pkt->size = 0;
                 pkt->stream_index = is->video_stream;
                 packet_queue_put(&is->videoq, pkt);
             }
-            if (is->audio_stream >= 0 &&
+            if (!end_queued && is->audio_stream >= 0 &&
                 is->audio_st->codec->codec->capabilities & CODEC_CAP_DELAY) {
                 av_init_packet(pkt);
                 pkt->data = NULL;
@@ -2358,39 +4722,89 @@ static int read_thread(void *arg)
                 pkt->stream_index = is->audio_stream;
                 packet_queue_put(&is->audioq, pkt);
             }
-            SDL_Delay(10);
+            end_queued = 1;
             if (is->audioq.size + is->videoq.size + is->subtitleq.size == 0) {
-                if (loop != 1 && (!loop || --loop)) {
+                if (is->loop_req && loop_cache_matches(is)) {
+                    stream_seek(is, is->loop_cache.seek_pos, 0, is->loop_cache.seek_by_bytes);
+                } else if (loop != 1 && (!loop || --loop)) {
                     stream_seek(is, start_time != AV_NOPTS_VALUE ? start_time : 0, 0, 0);
                 } else if (autoexit) {
                     ret = AVERROR_EOF;
                     goto fail;
                 }
             }
+            /* until the queues have emptied, or a seek, switch or loop */
+            if (!is->seek_req && !is->switch_req)
+                wakeup_wait(&is->read_wakeup, 0);
             eof=0;
             continue;
         }
+        if (!pack_map && is->pack_map_tid) {
+            SDL_LockMutex(is->pack_map_mutex);
+            pack_map = is->pack_map;
+            SDL_UnlockMutex(is->pack_map_mutex);
+            if (pack_map) {
+                int *ids = av_malloc(ic->nb_streams * sizeof(*ids));
+                if (ids) {
+                    for (i = 0; i < ic->nb_streams; i++)
+                        ids[i] = ic->streams[i]->id;
+                    packmap_resolve(pack_map, ids, ic->nb_streams);
+                    av_free(ids);
+                }
+            }
+        }
+        if (is->loop_cache.next_pkt) {
+            ret = loop_cache_get(is, pkt);
+            if (!is->loop_cache.next_pkt && !loop_cache_replay(is))
+                eof = 1;
+            if (ret < 0)
+                continue;
+            goto queue_packet;
+        }
+        /* the clip ends where its own streams do, for looping, switching
+           at the end and MEDIA_TIMER_EOS alike */
+        if (is->pack_map_tid && clip_read_out(is, pack_map, streams_ended)) {
+            eof = 1;
+            continue;
+        }
+        if (pack_map && pack_skip)
+            pack_skip_inactive(is, pack_map);
+        read_pos = ic->pb ? avio_tell(ic->pb) : 0;
+        start = stage_begin();
         ret = av_read_frame(ic, pkt);
+        stage_end(is, STAGE_READ, start);
+        if (ic->pb)
+            is->bytes_read += FFMAX(avio_tell(ic->pb) - read_pos, 0);
         if (ret < 0) {
             if (ret == AVERROR_EOF || url_feof(ic->pb))
                 eof = 1;
             if (ic->pb && ic->pb->error)
                 break;
-            SDL_LockMutex(wait_mutex);
-            SDL_CondWaitTimeout(is->continue_read_thread, wait_mutex, 10);
-            SDL_UnlockMutex(wait_mutex);
+            /* a retry, unless a request comes in first */
+            if (!eof)
+                wakeup_wait(&is->read_wakeup, 10);
             continue;
         }
+        end_queued = 0;
+        if (is->pack_map_tid && pkt->stream_index < 64 &&
+            packet_ends_stream(ic->streams[pkt->stream_index], pkt))
+            streams_ended |= UINT64_C(1) << pkt->stream_index;
+queue_packet:
         /* check if packet is in play range specified by user, then queue, otherwise discard */
         pkt_in_play_range = duration == AV_NOPTS_VALUE ||
                 (pkt->pts - ic->streams[pkt->stream_index]->start_time) *
                 av_q2d(ic->streams[pkt->stream_index]->time_base) -
                 (double)(start_time != AV_NOPTS_VALUE ? start_time : 0) / 1000000
                 <= ((double)duration / 1000000);
+        if (pkt_in_play_range)
+            loop_cache_add(is, pkt);
+        if ((pkt->stream_index == is->audio_stream || pkt->stream_index == is->video_stream) &&
+            pkt_in_play_range)
+            segment_rebase_packet(is, pkt);
         if (pkt->stream_index == is->audio_stream && pkt_in_play_range) {
-            packet_queue_put(&is->audioq, pkt);
+            packet_queue_put_timed(&is->audioq, pkt, packet_duration(ic->streams[pkt->stream_index], pkt));
         } else if (pkt->stream_index == is->video_stream && pkt_in_play_range) {
-            packet_queue_put(&is->videoq, pkt);
+            packet_queue_put_timed(&is->videoq, pkt, packet_duration(ic->streams[pkt->stream_index], pkt));
         } else if (pkt->stream_index == is->subtitle_stream && pkt_in_play_range) {
             packet_queue_put(&is->subtitleq, pkt);
         } else {
@@ -2399,7 +4813,7 @@ static int read_thread(void *arg)
     }
     /* wait until the end */
     while (!is->abort_request) {
-        SDL_Delay(100);
+        wakeup_wait(&is->read_wakeup, 0);
     }
 
     ret = 0;
@@ -2414,6 +4828,16 @@ static int read_thread(void *arg)
     if (is->ic) {
         avformat_close_input(&is->ic);
     }
+    prefetch_close(&is->prefetch_pb);
+
+    if (is->pack_map_tid) {
+        SDL_WaitThread(is->pack_map_tid, NULL);
+        is->pack_map_tid = NULL;
+    }
+    if (is->pack_map) {
+        packmap_free(is->pack_map);
+        av_freep(&is->pack_map);
+    }
 
     if (ret != 0) {
         SDL_Event event;
@@ -2422,13 +4846,13 @@ static int read_thread(void *arg)
         event.user.data1 = is;
         SDL_PushEvent(&event);
     }
-    SDL_DestroyMutex(wait_mutex);
     return 0;
 }
 
 VideoState *stream_open(const char *filename, AVInputFormat *iformat)
 {
     VideoState *is;
+    int i;
 
     is = av_mallocz(sizeof(VideoState));
     if (!is)
@@ -2441,6 +4865,8 @@ VideoState *stream_open(const char *filename, AVInputFormat *iformat)
     /* start video display */
     is->pictq_mutex = SDL_CreateMutex();
     is->pictq_cond  = SDL_CreateCond();
+    is->convert_mutex = SDL_CreateMutex();
+    is->convert_cond  = SDL_CreateCond();
 
     is->subpq_mutex = SDL_CreateMutex();
     is->subpq_cond  = SDL_CreateCond();
@@ -2449,18 +4875,50 @@ VideoState *stream_open(const char *filename, AVInputFormat *iformat)
     packet_queue_init(&is->audioq);
     packet_queue_init(&is->subtitleq);
 
-    is->continue_read_thread = SDL_CreateCond();
+    is->videoq.target = video_queue_ms * 1000LL;
+    is->audioq.target = audio_queue_ms * 1000LL;
+    wakeup_init(&is->read_wakeup);
+    is->videoq.reader    = &is->read_wakeup;
+    is->audioq.reader    = &is->read_wakeup;
+    is->subtitleq.reader = &is->read_wakeup;
+    is->pause_mutex = SDL_CreateMutex();
+    is->pause_cond  = SDL_CreateCond();
+    is->pack_map_mutex = SDL_CreateMutex();
+    is->switch_mutex   = SDL_CreateMutex();
+    is->timer_mutex    = SDL_CreateMutex();
+    wakeup_init(&is->audio_ring_wakeup);
+    pcm_ring_init(&is->audio_ring, AUDIO_RING_SIZE);
+    is->layer.mutex    = SDL_CreateMutex();
+    is->layer.cond     = SDL_CreateCond();
+    if (layer_enable)
+        pcm_ring_init(&is->layer.pcm, LAYER_PCM_SIZE);
+
+    for (i = 0; i < MEDIA_TIMER_NB; i++) {
+        is->timers[i].next = is->timer_free;
+        is->timer_free = &is->timers[i];
+    }
+    is->segments[0].start = -INFINITY;
+    is->nb_segments    = 1;
+    is->queued_end_pts = AV_NOPTS_VALUE;
 
     update_external_clock_pts(is, NAN);
     update_external_clock_speed(is, 1.0);
-    is->audio_current_pts_drift = -av_gettime() / 1000000.0;
+    is->audio_current_pts_drift = -mclock_now();
     is->video_current_pts_drift = is->audio_current_pts_drift;
     is->audio_clock_serial = -1;
     is->video_clock_serial = -1;
     is->av_sync_type = av_sync_type;
+    is->loop_req     = loop_clip;
+    reclaimer_start(&is->reclaim);
+    is->videoq.reclaim    = &is->reclaim;
+    is->audioq.reclaim    = &is->reclaim;
+    is->subtitleq.reclaim = &is->reclaim;
+    is->convert_tid  = SDL_CreateThread(convert_thread, is);
+    loop_cache_reset(is);
     is->read_tid     = SDL_CreateThread(read_thread, is);
     if (!is->read_tid) {
-        av_free(is);
+        /* the convert and reclaim threads are running already */
+        stream_close(is);
         return NULL;
     }
     return is;
@@ -2554,19 +5012,27 @@ static void toggle_audio_display(VideoState *is)
     }
 }
 
+/* Sleep to absolute deadlines: the refresh a due picture should go out
+   for, or the next input poll when nothing is due before it. */
 static void refresh_loop_wait_event(VideoState *is, SDL_Event *event) {
-    double remaining_time = 0.0;
+    double remaining_time = 0.0, wakeup = 0.0;
     SDL_PumpEvents();
     while (!SDL_PeepEvents(event, 1, SDL_GETEVENT, SDL_ALLEVENTS)) {
-        if (!cursor_hidden && av_gettime() - cursor_last_shown > CURSOR_HIDE_DELAY) {
+        if (!cursor_hidden && mclock_gettime() - cursor_last_shown > CURSOR_HIDE_DELAY) {
             SDL_ShowCursor(0);
             cursor_hidden = 1;
         }
         if (remaining_time > 0.0)
-            av_usleep((int64_t)(remaining_time * 1000000.0));
-        remaining_time = REFRESH_RATE;
+            mclock_sleep_until(llrint(wakeup * 1000000.0));
+        remaining_time = benchmark_mode ? 0.001 : EVENT_POLL_INTERVAL;
+        /* one time for the whole pass */
+        mclock_freeze();
         if (is->show_mode != SHOW_MODE_NONE && (!is->paused || is->force_refresh))
             video_refresh(is, &remaining_time);
+        wakeup = mclock_now() + remaining_time;
+        if (remaining_time < EVENT_POLL_INTERVAL && !display_disable)
+            wakeup = FFMAX(present_wakeup(&present_clock, wakeup), mclock_now());
+        mclock_thaw();
         SDL_PumpEvents();
     }
 }
@@ -2672,7 +5138,7 @@ void ffplay_event_loop(VideoState *cur_stream)
                 SDL_ShowCursor(1);
                 cursor_hidden = 0;
             }
-            cursor_last_shown = av_gettime();
+            cursor_last_shown = mclock_gettime();
             if (event.type == SDL_MOUSEBUTTONDOWN) {
                 x = event.button.x;
             } else {
@@ -2707,6 +5173,7 @@ void ffplay_event_loop(VideoState *cur_stream)
         case SDL_VIDEORESIZE:
                 screen = SDL_SetVideoMode(event.resize.w, event.resize.h, 0,
                                           SDL_HWSURFACE|SDL_RESIZABLE|SDL_ASYNCBLIT|SDL_HWACCEL);
+                present_mode_set();
                 screen_width  = cur_stream->width  = event.resize.w;
                 screen_height = cur_stream->height = event.resize.h;
                 cur_stream->force_refresh = 1;
@@ -2775,6 +5242,11 @@ VideoState *ffplay_init(const char *resource_file)
     if (display_disable) {
         video_disable = 1;
     }
+    if (benchmark_mode) {
+        /* nothing is late when there is no schedule */
+        framedrop = 0;
+        quality_governor = 0;
+    }
     flags = SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER;
     if (audio_disable)
         flags &= ~SDL_INIT_AUDIO;
@@ -2800,6 +5272,7 @@ VideoState *ffplay_init(const char *resource_file)
     SDL_EventState(SDL_ACTIVEEVENT, SDL_IGNORE);
     SDL_EventState(SDL_SYSWMEVENT, SDL_IGNORE);
     SDL_EventState(SDL_USEREVENT, SDL_IGNORE);
+    present_init(&present_clock, display_refresh_rate);
 
     if (av_lockmgr_register(lockmgr)) {
         fprintf(stderr, "Could not initialize lock manager!\n");
@@ -2814,6 +5287,8 @@ VideoState *ffplay_init(const char *resource_file)
         fprintf(stderr, "Failed to initialize VideoState!\n");
         do_exit(NULL);
     }
+    if (simulation_mode)
+        mclock_virtual_gate(simulation_ready, is);
 
     return is;
 }
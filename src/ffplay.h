@@ -9,6 +9,18 @@
 #define VIDEO_PICTURE_QUEUE_SIZE 4
 #define SUBPICTURE_QUEUE_SIZE 4
 
+/* stream_switch() flags */
+#define SWITCH_AT_END   1   ///< wait until the current clip has been read completely
+#define SWITCH_LOOP     2   ///< loop the new clip from memory
+#define SWITCH_CROSSFADE 4  ///< fade the old clip out over the new one
+
+#define SEGMENT_NB      8
+#define MEDIA_TIMER_NB      32
+#define MEDIA_TIMER_SLOTS   64      ///< power of two
+#define MEDIA_TIMER_TICK    0.04    ///< seconds per wheel slot, one frame at 25 fps
+#define MEDIA_TIMER_START   (-INFINITY) ///< as soon as the segment is on screen
+#define MEDIA_TIMER_EOS     INFINITY    ///< when the segment is left or has played out
+
 typedef struct AudioParams {
     int freq;
     int channels;
@@ -16,27 +28,219 @@ typedef struct AudioParams {
     enum AVSampleFormat fmt;
 } AudioParams;
 
+/* Wakes a thread sleeping until something changes. Sending takes no lock,
+ * so the real-time audio callback can send one. The flag is left set, so a
+ * wakeup sent just before the thread goes to sleep is not lost and the
+ * sleep needs no timeout. */
+typedef struct Wakeup {
+    volatile int pending;       ///< futex word
+    volatile int waiting;       ///< threads in wakeup_wait()
+} Wakeup;
+
 typedef struct MyAVPacketList {
     AVPacket pkt;
     struct MyAVPacketList *next;
     int serial;
+    int64_t duration;           ///< in AV_TIME_BASE units, 0 if unknown
+    PacketSlab *slab;           ///< of the node, for queued packets
 } MyAVPacketList;
 
 typedef struct PacketQueue {
     MyAVPacketList *first_pkt, *last_pkt;
     int nb_packets;
     int size;
+    int64_t duration;           ///< of the packets queued, AV_TIME_BASE units
+    int64_t target;             ///< read-ahead wanted, the reader resumes below half
     int abort_request;
     int serial;
     SDL_mutex *mutex;
     SDL_cond *cond;
+    Wakeup *reader;             ///< woken as the queue drains, NULL for none
+    int drained;                ///< bytes taken out since the reader was last woken
+    PacketArena arena;          ///< nodes of the queued packets
+    struct Reclaimer *reclaim;  ///< frees what a flush drops, NULL to free it in place
 } PacketQueue;
 
+/* The packets of a cached clip once it is replayed. The replayed packets
+ * point into their payloads, so they are only freed when the cache has let
+ * go of them and the decoders are done with the last of those. */
+typedef struct LoopCacheHold {
+    volatile int refs;          ///< the cache's own, and one per packet handed out
+    MyAVPacketList *pkts;
+    struct Reclaimer *reclaim;  ///< frees pkts in the end
+} LoopCacheHold;
+
+/* Compressed packets of one clip, kept in memory so that it can be looped
+ * without going back to the demuxer */
+typedef struct LoopCache {
+    MyAVPacketList *first_pkt, *last_pkt;
+    MyAVPacketList *next_pkt;   ///< next packet to replay, NULL when reading from the file
+    int64_t size;               ///< payload bytes held
+    int video_stream;
+    int audio_stream;
+    int recording;
+    int complete;               ///< the whole clip is cached
+    int overflow;               ///< the clip did not fit the budget, loop by seeking
+    int64_t seek_pos;           ///< entry point of the clip, for the seek fallback
+    int seek_by_bytes;
+    int64_t start_pts;          ///< span of the cached video, AV_TIME_BASE units
+    int64_t end_pts;
+    int loops;                  ///< replays started, timestamps are offset by this many spans
+    LoopCacheHold *hold;        ///< the packets from the first replay on, NULL before
+} LoopCache;
+
+/* A clip as it appears on the presentation timeline. Clips joined by
+ * stream_switch() follow each other without a flush, their timestamps being
+ * moved on by offset so that the timeline stays continuous. */
+typedef struct Segment {
+    int id;
+    int64_t offset;             ///< added to the clip timestamps, AV_TIME_BASE units
+    double start;               ///< presentation time of the first frame
+} Segment;
+
+struct VideoState;
+typedef void (*MediaTimerCallback)(struct VideoState *is, void *opaque);
+
+typedef struct MediaTimer {
+    int segment;
+    double pts;                 ///< clip time, MEDIA_TIMER_START or MEDIA_TIMER_EOS
+    MediaTimerCallback cb;
+    void *opaque;
+    struct MediaTimer *next;
+} MediaTimer;
+
+#define AUDIO_RING_SIZE (128 * 1024)  ///< power of two
+
+#define AUDIO_CACHE_NB 8
+
+/* A packet is known by its pos and its place among the packets of that pos:
+ * the parser splits the frames of one PES out with the same pos. */
+typedef struct AudioCacheChunk {
+    int64_t pos;                ///< of the packet the samples were decoded from
+    int index;                  ///< packets of the stream at pos before this one
+    int offset, size;           ///< in AudioCache.data
+} AudioCacheChunk;
+
+/* The whole of a short audio stream, decoded up front in the device
+ * format, so that playing it again costs no decoding or resampling */
+typedef struct AudioCache {
+    int stream;
+    uint8_t *data;
+    int size;
+    AudioCacheChunk *chunks;    ///< one per packet, in file order
+    int nb_chunks;
+} AudioCache;
+
+#define AUDIO_EFFECT_NB 8
+
+/* A short sound, decoded up front and mixed over the stream audio */
+typedef struct AudioEffect {
+    uint8_t *data;              ///< in the device format
+    int size;
+    int pos;                    ///< playing position, -1 when idle
+} AudioEffect;
+
+#define LAYER_QUEUE_SIZE 3
+#define LAYER_PCM_SIZE  (256 * 1024)    ///< power of two
+
+/* layer modes */
+#define LAYER_FADE_OUT  0   ///< full frame, from opaque to transparent over the duration
+#define LAYER_PIP       1   ///< opaque, scaled into the bottom right corner
+
+typedef struct LayerPicture {
+    AVPicture pict;             ///< YUV420P, at the size it is blended at
+    int width, height;
+    double pts;                 ///< seconds from the first frame of the layer
+} LayerPicture;
+
+/* A second video stream, decoded from its own demuxer and composited over
+ * the pictures of the main one as they are queued. */
+typedef struct Layer {
+    SDL_Thread *tid;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    int req;                    ///< a new layer is waiting to be started
+    int active;
+    int eof;
+    int stream;
+    int mode;
+    double clip_time;           ///< where the layer starts in its stream, seconds
+    double start;               ///< main presentation time it is shown from
+    double duration;            ///< of the fade, 0 for as long as the stream lasts
+    int width, height;          ///< of the main pictures
+    LayerPicture pictq[LAYER_QUEUE_SIZE];
+    int size, rindex, windex;
+    struct SwsContext *sws_ctx;
+    double blend_cost;          ///< running average of the time a blend takes
+    int64_t blended, skipped;   ///< layer pictures composited, and left out as missing or late
+
+    int audio_stream;           ///< faded out by the audio callback, -1 for none
+    PCMRing pcm;                ///< decoded audio, in the device format
+    struct SwrContext *swr_ctx;
+    volatile int pcm_reset;     ///< set on a new request, cleared by the callback
+    int pcm_gain;               ///< Q15, owned by the audio callback
+} Layer;
+
 typedef struct SubPicture {
     double pts; /* presentation time stamp for this picture */
     AVSubtitle sub;
 } SubPicture;
 
+/* Something to free, handed to the reclaimer so that the thread letting go
+ * of it does not pay for the free. Any of the members may be set. */
+typedef struct ReclaimItem {
+    struct ReclaimItem *next;
+    MyAVPacketList *pkts;       ///< a chain of nodes, with their packets
+    PacketSlab *slabs;          ///< arena slabs the nodes of pkts live in, freed with them
+    AVSubtitle sub;
+    AVFrame *frame;
+    void *buf;
+} ReclaimItem;
+
+typedef struct Reclaimer {
+    SDL_Thread *tid;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    ReclaimItem *first, *last;
+    int abort_request;          ///< once set, items are freed by the caller
+} Reclaimer;
+
+typedef struct VideoPLL {
+    int serial;                 ///< packet queue serial the loop was started for
+    double frame_pts;           ///< frame the last correction was made after
+    int locked;
+    int lock_count;             ///< frames in a row inside the lock window
+    int unlocks;                ///< times lock was lost
+    double error;               ///< last video - master clock difference
+    double error_sq;            ///< running mean square of the error
+    double integral;            ///< accumulated error
+    double adjust;              ///< last correction of the frame delay
+    double unlock_time;         ///< when lock was last lost
+    double lock_time;           ///< seconds the last lock took to acquire
+} VideoPLL;
+
+/* pipeline stages timed in benchmark_mode */
+enum {
+    STAGE_READ,
+    STAGE_VIDEO_DECODE,
+    STAGE_AUDIO_DECODE,
+    STAGE_CONVERT,
+    STAGE_COMPOSITE,
+    STAGE_DISPLAY,
+    STAGE_NB
+};
+
+#define QUALITY_LEVELS 5
+
+typedef struct QualityGovernor {
+    int level;                  ///< 0 for the configured decoder settings
+    int calm;                   ///< consecutive GOPs decoded with headroom
+    int frames;                 ///< pictures decoded since the last GOP boundary
+    int64_t decode_time;        ///< microseconds spent decoding them
+    int pictq_fill;             ///< sum of the picture queue levels seen
+    int drops;                  ///< drop counters at the last GOP boundary
+} QualityGovernor;
+
 typedef struct VideoPicture {
     double pts;             // presentation timestamp for this picture
     int64_t pos;            // byte position in file
@@ -46,11 +250,14 @@ typedef struct VideoPicture {
     int allocated;
     int reallocate;
     int serial;
+    AVFrame *frame;         // decoded picture, its buffer held until converted
+    int converted;          // bmp holds the picture
 } VideoPicture;
 
 typedef struct VideoState {
     SDL_Thread *read_tid;
     SDL_Thread *video_tid;
+    SDL_Thread *pack_map_tid;
     AVInputFormat *iformat;
     int no_background;
     int abort_request;
@@ -64,13 +271,48 @@ typedef struct VideoState {
     int64_t seek_rel;
     int read_pause_return;
     AVFormatContext *ic;
+    AVIOContext *prefetch_pb;   ///< read-ahead under ic, NULL when avio reads the file
     int realtime;
 
+    struct PackMap *pack_map;   ///< set by pack_map_thread once the scan is complete
+    SDL_mutex *pack_map_mutex;
+    int64_t bytes_read;         ///< bytes consumed by the demuxer
+    int64_t bytes_skipped;      ///< bytes jumped over using the pack map
+
+    int loop_req;               ///< loop the current clip gaplessly from memory
+    LoopCache loop_cache;
+
+    int switch_req;
+    int switch_video_stream;
+    int switch_audio_stream;
+    int64_t switch_pos;
+    int switch_flags;
+    int switch_segment;         ///< id handed out for the pending switch
+    int next_segment_id;
+    SDL_mutex *switch_mutex;    ///< serialises codec open/close between reader and decoders
+    int64_t ts_offset;          ///< added to the timestamps of queued packets, AV_TIME_BASE units
+    int64_t queued_end_pts;     ///< end of the last queued video (or audio) packet, AV_TIME_BASE units
+    int read_eof;               ///< the reader has nothing more to queue
+
+    Segment segments[SEGMENT_NB];
+    int nb_segments;
+    int segment_id;             ///< id of the last segment started by the reader
+
+    SDL_mutex *timer_mutex;     ///< protects the timers and segments
+    MediaTimer timers[MEDIA_TIMER_NB];
+    MediaTimer *timer_free;
+    MediaTimer *timer_wheel[MEDIA_TIMER_SLOTS];
+    MediaTimer *timer_eos;      ///< timers at MEDIA_TIMER_START/EOS, outside the wheel
+    int timer_segment;          ///< segment being presented
+    int64_t timer_tick;         ///< last clip time the wheel was advanced to, in ticks
+    int timer_rescan;           ///< a timer was added, walk the whole wheel once
+
     int audio_stream;
 
     int av_sync_type;
+    VideoPLL video_pll;         ///< state of the VIDEO_SYNC_PLL mode
     double external_clock;                   ///< external clock base
-    double external_clock_drift;             ///< external clock base - time (av_gettime) at which we updated external_clock
+    double external_clock_drift;             ///< external clock base - time (mclock) at which we updated external_clock
     int64_t external_clock_time;             ///< last reference time
     double external_clock_speed;             ///< speed of the external clock
 
@@ -81,14 +323,33 @@ typedef struct VideoState {
     double audio_diff_threshold;
     int audio_diff_avg_count;
     AVStream *audio_st;
+    AVStream *audio_dec_st;     ///< stream the audio decoder is on, lags audio_st across a switch
     PacketQueue audioq;
     int audio_hw_buf_size;
-    uint8_t silence_buf[SDL_AUDIO_BUFFER_SIZE];
+    int audio_hw_delay;         ///< bytes queued in the device, -1 if unknown
+    AlsaOutput alsa;
+    SDL_Thread *audio_tid;
+    PCMRing audio_ring;         ///< decoded audio waiting for the device
+    Wakeup audio_ring_wakeup;   ///< sent by the callback as it makes room
+    volatile unsigned audio_drop_index; ///< after a flush the callback skips to here
+    volatile unsigned audio_drop_seq;
+    unsigned audio_drop_seen;
+    volatile unsigned audio_clock_seq;  ///< odd while the three below are being updated
+    volatile unsigned audio_clock_windex; ///< ring index audio_clock_pts applies to
+    volatile double audio_clock_pts;
+    volatile int audio_clock_pub_serial;
+    int audio_underruns;
+    SDL_Thread *audio_cache_tid;
+    AudioCache audio_cache[AUDIO_CACHE_NB];
+    volatile int nb_audio_cache;    ///< set once the cache is complete
+    int64_t audio_cache_hits;   ///< packets played from the cache instead of decoded
+    int64_t audio_pkt_pos;      ///< pos and index of the packet being decoded, see AudioCacheChunk
+    int audio_pkt_index;
+    AudioEffect effects[AUDIO_EFFECT_NB];
+    volatile unsigned effects_pending;  ///< bit mask of effects to (re)start
     uint8_t *audio_buf;
     uint8_t *audio_buf1;
-    unsigned int audio_buf_size; /* in bytes */
     unsigned int audio_buf1_size;
-    int audio_buf_index; /* in bytes */
     int audio_write_buf_size;
     AVPacket audio_pkt_temp;
     AVPacket audio_pkt;
@@ -100,6 +361,11 @@ typedef struct VideoState {
     double audio_current_pts_drift;
     int frame_drops_early;
     int frame_drops_late;
+    int frames_decoded;
+    int frames_skipped;         ///< non-reference pictures not decoded, predicted late
+    double decode_cost[AV_PICTURE_TYPE_BI + 1];  ///< seconds, running average per picture type
+    QualityGovernor governor;   ///< decoder quality stepped down under CPU pressure
+    int64_t stage_time[STAGE_NB];   ///< microseconds spent in each stage, in benchmark_mode
     AVFrame *frame;
 
     enum ShowMode {
@@ -131,8 +397,14 @@ typedef struct VideoState {
     double frame_last_returned_time;
     double frame_last_filter_delay;
     int64_t frame_last_dropped_pos;
+    volatile int frame_reset_serial;    ///< serial of the last flush the video thread has seen
+    volatile int frame_timing_serial;   ///< the flush video_refresh last reset the timing for
     int video_stream;
     AVStream *video_st;
+    AVStream *video_dec_st;     ///< stream the video decoder is on, lags video_st across a switch
+    AVPacket video_switch_pkt;  ///< first packet of the next stream, held while the old decoder drains
+    Layer layer;
+    int video_finished;         ///< the decoder has returned everything it was given
     PacketQueue videoq;
     double video_current_pts;       // current displayed pts
     double video_current_pts_drift; // video_current_pts - time (av_gettime) at which we updated video_current_pts - used to have running video pts
@@ -140,10 +412,19 @@ typedef struct VideoState {
     double max_frame_duration;      // maximum duration of a frame - above this, we consider the jump a timestamp discontinuity
     int video_clock_serial;
     VideoPicture pictq[VIDEO_PICTURE_QUEUE_SIZE];
-    int pictq_size, pictq_rindex, pictq_windex;
+    volatile int pictq_size;    ///< changed atomically, each index only by its own side
+    int pictq_rindex, pictq_windex;
+    volatile int pictq_waiting; ///< the video thread sleeps on pictq_cond
     SDL_mutex *pictq_mutex;
     SDL_cond *pictq_cond;
     struct SwsContext *img_convert_ctx;
+    struct FrameBuffer *buffer_pool;    ///< decoded pictures, for the video decoders
+    SDL_Thread *convert_tid;
+    SDL_mutex *convert_mutex;
+    SDL_cond *convert_cond;
+    VideoPicture *convert_req;  ///< picture being converted, set by the display loop only
+    int conversions;            ///< pictures converted for display
+    int conversions_saved;      ///< decoded pictures dropped without being converted
     SDL_Rect last_display_rect;
 
     char filename[1024];
@@ -152,17 +433,37 @@ typedef struct VideoState {
 
     int last_video_stream, last_audio_stream, last_subtitle_stream;
 
-    SDL_cond *continue_read_thread;
+    Wakeup read_wakeup;         ///< the queues drained, or a request for the reader
+    Reclaimer reclaim;          ///< low priority thread doing the bulk frees
+    SDL_mutex *pause_mutex;
+    SDL_cond *pause_cond;       ///< broadcast when paused changes
 } VideoState;
 
 extern const char *input_filename;
 extern SDL_Surface *screen;
 extern int display_disable;
+extern int benchmark_mode;
+extern int simulation_mode;
 extern int audio_disable;
 extern int video_disable;
 extern AVPacket flush_pkt;
 extern AVInputFormat *file_iformat;
 extern int wanted_stream[AVMEDIA_TYPE_NB];
+extern int loop_clip;
+extern int64_t loop_cache_budget;
+extern int video_queue_ms;
+extern int audio_queue_ms;
+extern int io_prefetch_kb;
+extern int io_block_kb;
+extern int64_t audio_cache_max;
+extern int audio_buffer_size;
+extern const char *audio_device;
+extern int audio_periods;
+extern int audio_rt_priority;
+extern int layer_enable;
+extern int thread_budget;
+extern double crossfade_duration;
+extern int display_vsync;
 
 extern void sigterm_handler(int sig);
 extern int lockmgr(void **mtx, enum AVLockOp op);
@@ -178,6 +479,17 @@ extern int stream_component_open(VideoState *is, int stream_index);
 
 extern void stream_seek(VideoState *is, int64_t pos, int64_t rel, 
 		int seek_by_bytes);
+extern void stream_set_loop(VideoState *is, int loop_clip);
+extern int stream_switch(VideoState *is, int video_stream, int audio_stream,
+		int64_t pos, int flags);
+extern int audio_cache_add(int stream_index);
+extern int audio_effect_add(const char *filename);
+extern void audio_effect_play(VideoState *is, int effect);
+extern int layer_start(VideoState *is, int video_stream, double clip_time,
+		int mode, double duration);
+extern void layer_stop(VideoState *is);
+extern int media_timer_add(VideoState *is, int segment, double pts,
+		MediaTimerCallback cb, void *opaque);
 extern int video_open(VideoState *is, int force_set_video_mode, 
 		VideoPicture *vp);
 
@@ -1,3 +1,5 @@
+#include <stdlib.h>
+#include <string.h>
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -9,7 +11,12 @@
 #include <libavformat/avformat.h>
 #include <libavcodec/avfft.h>
 
+#include "mixer.h"
+#include "alsaout.h"
+#include "pktarena.h"
 #include "ffplay.h"
+#include "bench.h"
+#include "mclock.h"
 #include "colorspace.h"
 
 #define PACKET_HEADER 0xff
@@ -17,6 +24,11 @@
 
 #define UART_NAME "hw:1"
 
+#define RESOURCE_DIR "/home/pi/ffplay_game/resource/"
+#define MEDIA_FILE RESOURCE_DIR "media.mpg"
+#define MANIFEST_FILE RESOURCE_DIR "media.manifest"
+#define BUTTON_SOUND RESOURCE_DIR "button.wav"
+
 typedef struct s_control_packet control_packet;
 
 struct s_control_packet {
@@ -49,37 +61,71 @@ struct s_game_data {
     snd_rawmidi_t *output, *input;
 };
 
+static int button_sound = -1;
+
 static struct s_game_data game_data = {
     .packet_list = NULL,
     .start_game = 0,
     .state = ATTRACT_MODE,
 };
 
-#define ATTRACT_VIDEO_STREAM	0
-#define ATTRACT_AUDIO_STREAM	1
-#define COUNTDOWN_VIDEO_STREAM	2
-#define COUNTDOWN_AUDIO_STREAM	3
-#define GAME_VIDEO_STREAM	4
-#define GAME_AUDIO_STREAM	5
-#define WINNER1_VIDEO_STREAM	6
-#define WINNER1_AUDIO_STREAM	7
-#define WINNER2_VIDEO_STREAM	8
-#define WINNER2_AUDIO_STREAM	9
-
-#define GAME_MODE(mode_name, video_stream, audio_stream) \
-    static void mode_name##_mode(VideoState *is) {			    \
-	stream_component_close(is, is->last_video_stream);		    \
-	stream_component_close(is, is->last_audio_stream);		    \
-	stream_component_open(is, video_stream);			    \
-	stream_component_open(is, audio_stream);			    \
-	stream_seek(is, 0, 0, 0);					    \
+#define NUM_MODES (WINNER2_MODE + 1)
+
+/* Stream layout of the media file, as written to the manifest by
+ * resource/build_assets.sh. The defaults match the order the clips are
+ * muxed in, for when no manifest is available. */
+struct s_mode_entry {
+    const char *name;
+    int video_stream;
+    int audio_stream;
+    double start;	    /* pts of the first frame, in seconds */
+    double duration;	    /* in seconds, 0 if unknown */
+    int64_t entry_pos;	    /* byte offset of the first packet, -1 if unknown */
+};
+
+static struct s_mode_entry modes[NUM_MODES] = {
+    [ATTRACT_MODE]	= { "attract",	    0, 1, 0, 0, -1 },
+    [COUNTDOWN_MODE]	= { "countdown",    2, 3, 0, 0, -1 },
+    [GAME_MODE]		= { "game",	    4, 5, 0, 0, -1 },
+    [WINNER1_MODE]	= { "winner1",	    6, 7, 0, 0, -1 },
+    [WINNER2_MODE]	= { "winner2",	    8, 9, 0, 0, -1 },
+};
+
+/* modes[] is only replaced once every mode has been found, so that a broken
+ * manifest leaves the default layout intact */
+static int load_manifest(const char *filename) {
+    FILE *f;
+    char line[256], name[32];
+    struct s_mode_entry parsed[NUM_MODES];
+    int i, video_stream, audio_stream, found = 0;
+    double start, duration;
+    long long entry_pos;
+
+    if (!(f = fopen(filename, "r"))) return -1;
+
+    memcpy(parsed, modes, sizeof(parsed));
+
+    while (fgets(line, sizeof(line), f)) {
+	if (line[0] == '#') continue;
+	if (sscanf(line, "%31s %d %d %lf %lf %lld", name, &video_stream,
+			&audio_stream, &start, &duration, &entry_pos) != 6)
+	    continue;
+	for (i = 0; i < NUM_MODES; i++) {
+	    if (strcmp(name, parsed[i].name)) continue;
+	    parsed[i].video_stream = video_stream;
+	    parsed[i].audio_stream = audio_stream;
+	    parsed[i].start = start;
+	    parsed[i].duration = duration;
+	    parsed[i].entry_pos = entry_pos;
+	    found |= 1 << i;
+	}
     }
+    fclose(f);
 
-GAME_MODE(attract, ATTRACT_VIDEO_STREAM, ATTRACT_AUDIO_STREAM)
-GAME_MODE(countdown, COUNTDOWN_VIDEO_STREAM, COUNTDOWN_AUDIO_STREAM)
-GAME_MODE(game, GAME_VIDEO_STREAM, GAME_AUDIO_STREAM)
-GAME_MODE(winner1, WINNER1_VIDEO_STREAM, WINNER1_AUDIO_STREAM)
-GAME_MODE(winner2, WINNER2_VIDEO_STREAM, WINNER2_AUDIO_STREAM)
+    if (found != (1 << NUM_MODES) - 1) return -1;
+    memcpy(modes, parsed, sizeof(modes));
+    return 0;
+}
 
 static int setup_uart(void) {
     return snd_rawmidi_open(&game_data.input, &game_data.output, UART_NAME, 0);
@@ -88,6 +134,8 @@ static int setup_uart(void) {
 static void write_uart(uint8_t instruction, uint8_t value) {
     uint8_t data[PACKET_SIZE];
 
+    if (!game_data.output) return;
+
     data[0] = PACKET_HEADER;
     data[1] = instruction;
     data[2] = value;
@@ -97,12 +145,36 @@ static void write_uart(uint8_t instruction, uint8_t value) {
     }
 }
 
+static void queue_packet(uint8_t instruction, uint8_t value) {
+    control_packet *new_packet;
+    control_packet *packet_mem;
+
+    /* Add to linked list */
+    packet_mem = malloc(sizeof(struct s_control_packet));
+    assert(packet_mem);
+    SDL_LockMutex(game_data.lock);
+
+    if (!game_data.packet_list) {
+	game_data.packet_list = packet_mem;
+	new_packet = game_data.packet_list;
+    } else {
+	new_packet = game_data.packet_list;
+	while (new_packet->next) new_packet = new_packet->next;
+	new_packet->next = packet_mem;
+	new_packet = new_packet->next;
+    }
+    new_packet->instruction = instruction;
+    new_packet->value = value;
+    new_packet->next = NULL;
+
+    SDL_CondSignal(game_data.data_ready);
+    SDL_UnlockMutex(game_data.lock);
+}
+
 static void read_uart(void) {
     int err;
     uint8_t data;
     static int byte_no;
-    control_packet *new_packet;
-    control_packet *packet_mem;
 
     if ((err = snd_rawmidi_read(game_data.input, &data, 1)) < 0) {
 	return;
@@ -116,26 +188,7 @@ static void read_uart(void) {
 	game_data.cur_instruction = data;
 	SDL_UnlockMutex(game_data.lock);
     } else if (byte_no == 2) {
-	/* Add to linked list */
-	packet_mem = malloc(sizeof(struct s_control_packet));
-	assert(packet_mem);
-	SDL_LockMutex(game_data.lock);
-
-	if (!game_data.packet_list) {
-	    game_data.packet_list = packet_mem;
-	    new_packet = game_data.packet_list;
-	} else {
-	    new_packet = game_data.packet_list;
-	    while (new_packet->next) new_packet = new_packet->next;
-	    new_packet->next = packet_mem;
-	    new_packet = new_packet->next;
-	}
-	new_packet->instruction = game_data.cur_instruction;
-	new_packet->value = data;
-	new_packet->next = NULL;
-
-	SDL_CondSignal(game_data.data_ready);
-	SDL_UnlockMutex(game_data.lock);
+	queue_packet(game_data.cur_instruction, data);
     }
 }
 
@@ -146,6 +199,7 @@ static int uart_func(void *p) {
 }
 
 static int data_func(void *p) {
+    VideoState *is = (VideoState *) p;
     int do_print;
     control_packet *packet;
     while (1) {
@@ -162,6 +216,8 @@ static int data_func(void *p) {
 	switch (packet->instruction >> 4) {
 	    case 0x01: /* Digital input */
 		if (packet->value == 1 && ((packet->instruction & 0xf) == 0)) {
+		    /* Mixed in by the audio callback, no mode switch needed */
+		    audio_effect_play(is, button_sound);
 		    game_data.start_game = 1;
 		    do_print = 1;
 		    SDL_CondSignal(game_data.state_changed);
@@ -300,31 +356,6 @@ void frame_modify_hook(SDL_Overlay *overlay) {
     SDL_UnlockYUVOverlay (overlay);
 }
 
-static void sleep_mode(void) {
-    int timeout = 0;
-    switch (game_data.state) {
-	case ATTRACT_MODE:
-	    SDL_LockMutex(game_data.lock);
-	    while (!game_data.start_game && !timeout)
-		timeout = SDL_CondWaitTimeout(game_data.state_changed,
-				game_data.lock, 18 * 1000);
-	    SDL_UnlockMutex(game_data.lock);
-	    break;
-	case COUNTDOWN_MODE:
-	    sleep(8);
-	    break;
-	case GAME_MODE:
-	    sleep(5);
-	    break;
-	case WINNER1_MODE:
-	    sleep(5);
-	    break;
-	case WINNER2_MODE:
-	    sleep(5);
-	    break;
-    }
-}
-
 static int choose_winner(void) {
     int retval;
     
@@ -338,96 +369,233 @@ static int choose_winner(void) {
     return retval;
 }
 
-static enum state_enum get_game_state(enum state_enum old_state) {
-    switch (old_state) {
-	case ATTRACT_MODE:
-	    SDL_LockMutex(game_data.lock);
-	    if (game_data.start_game) {
-		game_data.start_game = 0;
-		SDL_UnlockMutex(game_data.lock);
-		return COUNTDOWN_MODE;
-	    } else {
-		SDL_UnlockMutex(game_data.lock);
-		return ATTRACT_MODE;
-	    }
+/* The winner is chosen this long before the end of the game clip, so that
+ * the winner clip is queued behind it before the reader gets there. */
+#define DECIDE_LEAD 0.5
+
+static void queue_mode(VideoState *is, enum state_enum mode, int flags);
+static void sim_game_over(VideoState *is);
+
+/* Media timer callbacks, run by the event loop just before the first frame
+ * of a clip is displayed, so the game state changes on that very frame. */
+static void on_mode_start(VideoState *is, void *opaque) {
+    enum state_enum mode = (intptr_t) opaque;
+
+    SDL_LockMutex(game_data.lock);
+    game_data.state = mode;
+    if (mode == GAME_MODE) game_data.start_game = 0;
+    SDL_CondSignal(game_data.state_changed);
+    SDL_UnlockMutex(game_data.lock);
+
+    /* Queue the clip which follows, it starts on the frame after this
+     * one ends */
+    switch (mode) {
 	case COUNTDOWN_MODE:
-	    return GAME_MODE;
-	case GAME_MODE:
-	    if (choose_winner()) return WINNER1_MODE;
-	    else return WINNER2_MODE;
+	    queue_mode(is, GAME_MODE, SWITCH_AT_END);
+	    break;
 	case WINNER1_MODE:
 	case WINNER2_MODE:
-	    return ATTRACT_MODE;
+	    if (simulation_mode) sim_game_over(is);
+	    queue_mode(is, ATTRACT_MODE, SWITCH_AT_END | SWITCH_LOOP);
+	    break;
+	default:
+	    break;
     }
-    return ATTRACT_MODE;
 }
 
+static void on_game_end(VideoState *is, void *opaque) {
+    queue_mode(is, choose_winner() ? WINNER1_MODE : WINNER2_MODE,
+		    SWITCH_AT_END);
+}
+
+/* Play a mode after the current clip (SWITCH_AT_END) or as soon as what is
+ * already queued has played. With a manifest the entry point is a known
+ * byte offset, so no timestamp search is needed in the demuxer. */
+static void queue_mode(VideoState *is, enum state_enum mode, int flags) {
+    struct s_mode_entry *entry = &modes[mode];
+    int segment;
+
+    segment = stream_switch(is, entry->video_stream, entry->audio_stream,
+		    entry->entry_pos, flags);
+    media_timer_add(is, segment, MEDIA_TIMER_START, on_mode_start,
+		    (void *) (intptr_t) mode);
+    if (mode != GAME_MODE) return;
+    if (entry->duration > DECIDE_LEAD)
+	media_timer_add(is, segment,
+			entry->start + entry->duration - DECIDE_LEAD,
+			on_game_end, NULL);
+    else
+	media_timer_add(is, segment, MEDIA_TIMER_EOS, on_game_end, NULL);
+}
+
+static void set_lamp(enum state_enum mode, uint8_t value) {
+    if (mode == WINNER1_MODE) write_uart(0x11, value);
+    if (mode == WINNER2_MODE) write_uart(0x12, value);
+}
+
+/* Mode changes are made by the media timers, this thread only starts a game
+ * and drives the winner lamps. */
 static int stream_func(void *is_p) {
     VideoState *is = (VideoState *) is_p;
+    enum state_enum state = ATTRACT_MODE, last_state;
+    int starting = 0;
 
-    sleep_mode();
-
+    SDL_LockMutex(game_data.lock);
     while (1) {
-	game_data.state = get_game_state(game_data.state);
-	switch (game_data.state) {
-	    case ATTRACT_MODE:
-		attract_mode(is);
-		sleep_mode();
-		break;
+	last_state = state;
+	state = game_data.state;
+	if (state != last_state) {
+	    starting = 0;
+	    SDL_UnlockMutex(game_data.lock);
+	    set_lamp(last_state, 0x00);
+	    set_lamp(state, 0x01);
+	    SDL_LockMutex(game_data.lock);
+	    continue;
+	}
+	if (state == ATTRACT_MODE && game_data.start_game && !starting) {
+	    game_data.start_game = 0;
+	    starting = 1;
+	    SDL_UnlockMutex(game_data.lock);
+	    /* the attract clip fades out over the start of the countdown */
+	    queue_mode(is, COUNTDOWN_MODE, SWITCH_CROSSFADE);
+	    SDL_LockMutex(game_data.lock);
+	    continue;
+	}
+	SDL_CondWait(game_data.state_changed, game_data.lock);
+    }
+    SDL_UnlockMutex(game_data.lock);
 
-	    case COUNTDOWN_MODE:
-		countdown_mode(is);
-		sleep_mode();
-		break;
+    return 0;
+}
 
-	    case GAME_MODE:
-		game_mode(is);
-		SDL_LockMutex(game_data.lock);
-		game_data.start_game = 0;
-		SDL_UnlockMutex(game_data.lock);
-		/* draw bar graphs (in a separate thread) */
-		sleep_mode();
-		break;
+/* Run as the game would show the mode, for frame_modify_hook */
+static void bench_start(int mode) {
+    SDL_LockMutex(game_data.lock);
+    game_data.state = mode;
+    SDL_UnlockMutex(game_data.lock);
+}
 
-	    case WINNER1_MODE:
-		winner1_mode(is);
-		write_uart(0x11, 0x01);
-		sleep_mode();
-		write_uart(0x11, 0x00);
-		break;
+/* game bench [mode|all]: play the modes flat out, without the uart */
+static int bench_modes(const char *name) {
+    BenchClip clips[NUM_MODES];
+    int i, n = 0;
+
+    for (i = 0; i < NUM_MODES; i++) {
+	if (strcmp(name, "all") && strcmp(name, modes[i].name)) continue;
+	clips[n].name = modes[i].name;
+	clips[n].id = i;
+	clips[n].video_stream = modes[i].video_stream;
+	clips[n].audio_stream = modes[i].audio_stream;
+	clips[n].entry_pos = modes[i].entry_pos;
+	n++;
+    }
+    if (!n) {
+	printf("Unknown mode %s\n", name);
+	return 1;
+    }
+    benchmark_run(MEDIA_FILE, clips, n, bench_start);
+    return 0;
+}
 
-	    case WINNER2_MODE:
-		winner2_mode(is);
-		write_uart(0x12, 0x01);
-		sleep_mode();
-		write_uart(0x12, 0x00);
-		break;
+/* game sim [games]: play games on virtual time, as fast as the CPU allows,
+ * with a simulated player instead of the uart. The display loop and the
+ * ALSA thread drive the clock, so the sync logic sees real speed. */
+#define SIM_DEFAULT_GAMES   100
+#define SIM_STEP	    250000	/* player reaction time, in microseconds */
+
+static int sim_games, sim_played;
+static int64_t sim_start;
+
+static void sim_game_over(VideoState *is) {
+    sim_played++;
+    printf("game %d of %d over after %.1f s\n", sim_played, sim_games,
+		    (mclock_gettime() - sim_start) / 1000000.0);
+    if (sim_played >= sim_games) do_exit(is);
+}
+
+/* Press start a while into the attract clip, then work the pots */
+static int sim_func(void *p) {
+    enum state_enum state;
+    int idle = 0;
+
+    while (1) {
+	mclock_usleep(SIM_STEP);
+	SDL_LockMutex(game_data.lock);
+	state = game_data.state;
+	SDL_UnlockMutex(game_data.lock);
+
+	if (state == GAME_MODE) {
+	    queue_packet(0x20 | (rand() & 1), rand() & 0xff);
+	} else if (state == ATTRACT_MODE) {
+	    if (++idle < 4 + rand() % 16) continue;
+	    idle = 0;
+	    queue_packet(0x10, 1);
 	}
     }
 
     return 0;
 }
 
-int main(void) {
+static int sim_run(int games) {
     VideoState *is;
 
-    wanted_stream[AVMEDIA_TYPE_AUDIO] = ATTRACT_AUDIO_STREAM;
-    wanted_stream[AVMEDIA_TYPE_VIDEO] = ATTRACT_VIDEO_STREAM;
+    sim_games = games > 0 ? games : SIM_DEFAULT_GAMES;
+    setenv("SDL_VIDEODRIVER", "dummy", 1);
+    setenv("SDL_AUDIODRIVER", "dummy", 1);
+    audio_device = "null";
+    simulation_mode = 1;
 
-    if (setup_uart() < 0) {
-	printf("Unable to open uart\n");
-	return 1;
-    }
+    sim_start = mclock_read();
+    mclock_set_virtual(sim_start);
+    mclock_virtual_attach();
+
+    is = ffplay_init(MEDIA_FILE);
+
+    SDL_CreateThread(stream_func, is);
+    SDL_CreateThread(data_func, is);
+    SDL_CreateThread(sim_func, NULL);
+
+    ffplay_event_loop(is);
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    VideoState *is;
+
+    if (load_manifest(MANIFEST_FILE) < 0)
+	printf("Unable to load %s, using default stream layout\n",
+			MANIFEST_FILE);
 
-    is = ffplay_init("/home/pi/ffplay_game/resource/media.mpg");
+    wanted_stream[AVMEDIA_TYPE_AUDIO] = modes[ATTRACT_MODE].audio_stream;
+    wanted_stream[AVMEDIA_TYPE_VIDEO] = modes[ATTRACT_MODE].video_stream;
+    loop_clip = 1;
+    layer_enable = 1;
+    button_sound = audio_effect_add(BUTTON_SOUND);
+    /* the short soundtracks are decoded once and replayed from memory */
+    audio_cache_add(modes[COUNTDOWN_MODE].audio_stream);
+    audio_cache_add(modes[WINNER1_MODE].audio_stream);
+    audio_cache_add(modes[WINNER2_MODE].audio_stream);
 
     game_data.lock = SDL_CreateMutex();
     game_data.data_ready = SDL_CreateCond();
     game_data.state_changed = SDL_CreateCond();
 
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+	return bench_modes(argc > 2 ? argv[2] : "all");
+    if (argc > 1 && !strcmp(argv[1], "sim"))
+	return sim_run(argc > 2 ? atoi(argv[2]) : SIM_DEFAULT_GAMES);
+
+    if (setup_uart() < 0) {
+	printf("Unable to open uart\n");
+	return 1;
+    }
+
+    is = ffplay_init(MEDIA_FILE);
+
     SDL_CreateThread(stream_func, is);
     SDL_CreateThread(uart_func, NULL);
-    SDL_CreateThread(data_func, NULL);
+    SDL_CreateThread(data_func, is);
 
     ffplay_event_loop(is);
 
@@ -0,0 +1,222 @@
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "mclock.h"
+
+static int64_t monotonic_gettime(void *opaque)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void monotonic_sleep_until(void *opaque, int64_t t)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = t / 1000000;
+    ts.tv_nsec = t % 1000000 * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static const MClockSource monotonic_source = {
+    monotonic_gettime, monotonic_sleep_until, NULL
+};
+
+static MClockSource source = {
+    monotonic_gettime, monotonic_sleep_until, NULL
+};
+
+static __thread int frozen;
+static __thread int64_t frozen_time;
+
+void mclock_set_source(const MClockSource *src)
+{
+    source = src ? *src : monotonic_source;
+}
+
+int64_t mclock_read(void)
+{
+    return source.gettime(source.opaque);
+}
+
+int64_t mclock_gettime(void)
+{
+    return frozen ? frozen_time : mclock_read();
+}
+
+void mclock_freeze(void)
+{
+    frozen_time = mclock_read();
+    frozen = 1;
+}
+
+void mclock_thaw(void)
+{
+    frozen = 0;
+}
+
+void mclock_sleep_until(int64_t t)
+{
+    source.sleep_until(source.opaque, t);
+}
+
+void mclock_usleep(int64_t usec)
+{
+    mclock_sleep_until(mclock_read() + usec);
+}
+
+typedef struct VirtualSleeper {
+    int64_t deadline;
+    struct VirtualSleeper *next;
+} VirtualSleeper;
+
+typedef struct VirtualClock {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int64_t time;
+    int participants;
+    int reserved;               /* participants yet to attach */
+    int sleeping;               /* participants asleep on the clock */
+    VirtualSleeper *sleepers;   /* everyone asleep, on their own stacks */
+    int (*ready)(void *opaque);
+    void *ready_opaque;
+} VirtualClock;
+
+static VirtualClock virtual_clock = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, NULL, NULL, NULL
+};
+
+static __thread int attached;
+
+/* Once every participant is asleep, jump to the first deadline. A sleeper
+   that has been woken stays on the list until it runs, so its deadline
+   holds the time where it is until then. mutex held. */
+static void virtual_advance(VirtualClock *vc)
+{
+    VirtualSleeper *s;
+    int64_t next = INT64_MAX;
+
+    if (!vc->participants || vc->sleeping < vc->participants ||
+        (vc->ready && !vc->ready(vc->ready_opaque)))
+        return;
+    for (s = vc->sleepers; s; s = s->next)
+        if (s->deadline < next)
+            next = s->deadline;
+    if (next != INT64_MAX && next > vc->time) {
+        vc->time = next;
+        pthread_cond_broadcast(&vc->cond);
+    }
+}
+
+static int64_t virtual_gettime(void *opaque)
+{
+    VirtualClock *vc = opaque;
+    int64_t t;
+
+    pthread_mutex_lock(&vc->mutex);
+    t = vc->time;
+    pthread_mutex_unlock(&vc->mutex);
+    return t;
+}
+
+static void virtual_sleep_until(void *opaque, int64_t t)
+{
+    VirtualClock *vc = opaque;
+    VirtualSleeper self = { t, NULL }, **p;
+
+    pthread_mutex_lock(&vc->mutex);
+    if (vc->time < t) {
+        self.next = vc->sleepers;
+        vc->sleepers = &self;
+        if (attached)
+            vc->sleeping++;
+        virtual_advance(vc);
+        while (vc->time < t)
+            pthread_cond_wait(&vc->cond, &vc->mutex);
+        for (p = &vc->sleepers; *p != &self; p = &(*p)->next)
+            ;
+        *p = self.next;
+        if (attached)
+            vc->sleeping--;
+        /* without its deadline the time may move on */
+        virtual_advance(vc);
+    }
+    pthread_mutex_unlock(&vc->mutex);
+}
+
+void mclock_set_virtual(int64_t t)
+{
+    MClockSource src = { virtual_gettime, virtual_sleep_until, &virtual_clock };
+
+    virtual_clock.time = t;
+    mclock_set_source(&src);
+}
+
+void mclock_virtual_attach(void)
+{
+    if (source.opaque != &virtual_clock || attached)
+        return;
+    pthread_mutex_lock(&virtual_clock.mutex);
+    if (virtual_clock.reserved > 0)
+        virtual_clock.reserved--;
+    else
+        virtual_clock.participants++;
+    attached = 1;
+    pthread_mutex_unlock(&virtual_clock.mutex);
+}
+
+int mclock_virtual_detach(void)
+{
+    if (!attached)
+        return 0;
+    pthread_mutex_lock(&virtual_clock.mutex);
+    virtual_clock.participants--;
+    attached = 0;
+    virtual_advance(&virtual_clock);
+    pthread_mutex_unlock(&virtual_clock.mutex);
+    return 1;
+}
+
+void mclock_virtual_reserve(int n)
+{
+    if (source.opaque != &virtual_clock)
+        return;
+    pthread_mutex_lock(&virtual_clock.mutex);
+    virtual_clock.participants += n;
+    virtual_clock.reserved     += n;
+    virtual_advance(&virtual_clock);
+    pthread_mutex_unlock(&virtual_clock.mutex);
+}
+
+void mclock_virtual_gate(int (*ready)(void *opaque), void *opaque)
+{
+    pthread_mutex_lock(&virtual_clock.mutex);
+    virtual_clock.ready        = ready;
+    virtual_clock.ready_opaque = opaque;
+    virtual_advance(&virtual_clock);
+    pthread_mutex_unlock(&virtual_clock.mutex);
+}
+
+void mclock_virtual_kick(void)
+{
+    if (source.opaque != &virtual_clock)
+        return;
+    pthread_mutex_lock(&virtual_clock.mutex);
+    virtual_advance(&virtual_clock);
+    pthread_mutex_unlock(&virtual_clock.mutex);
+}
+
+void mclock_virtual_set(int64_t t)
+{
+    pthread_mutex_lock(&virtual_clock.mutex);
+    if (t > virtual_clock.time) {
+        virtual_clock.time = t;
+        pthread_cond_broadcast(&virtual_clock.cond);
+    }
+    pthread_mutex_unlock(&virtual_clock.mutex);
+}
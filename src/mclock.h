@@ -0,0 +1,69 @@
+#ifndef MCLOCK_H
+#define MCLOCK_H
+
+#include <stdint.h>
+
+/* The clock all playback timing is taken from, in microseconds from an
+ * arbitrary start. It runs from CLOCK_MONOTONIC, so that stepping the system
+ * time does not upset sync, or from another source plugged in behind the
+ * same calls, such as the virtual time below.
+ *
+ * A thread can freeze its view of the clock for one pass over the sync
+ * code: every clock read in the pass then agrees, and the source is only
+ * read once. */
+
+typedef struct MClockSource {
+    int64_t (*gettime)(void *opaque);
+    void (*sleep_until)(void *opaque, int64_t t);
+    void *opaque;
+} MClockSource;
+
+/* Replace the clock source, before any thread uses the clock. NULL goes
+ * back to CLOCK_MONOTONIC. */
+void mclock_set_source(const MClockSource *src);
+
+/* the frozen time if the calling thread has frozen the clock */
+int64_t mclock_gettime(void);
+
+static inline double mclock_now(void)
+{
+    return mclock_gettime() / 1000000.0;
+}
+
+/* the source itself, for measuring how long something takes */
+int64_t mclock_read(void);
+
+void mclock_freeze(void);
+void mclock_thaw(void);
+
+void mclock_sleep_until(int64_t t);
+void mclock_usleep(int64_t usec);
+
+/* Virtual time, starting at t. It stands still until mclock_virtual_set()
+ * moves it on, waking the threads sleeping to a deadline it passes, or,
+ * once threads have attached, until all of those are asleep on the clock:
+ * it then jumps to the first deadline of any sleeper. Whatever the attached
+ * threads do between two sleeps takes no time at all. */
+void mclock_set_virtual(int64_t t);
+void mclock_virtual_set(int64_t t);
+
+/* The calling thread drives virtual time, a no-op on a real clock. A
+ * driving thread has to detach before waiting for another one that may be
+ * asleep on the clock. detach returns whether the thread was attached. */
+void mclock_virtual_attach(void);
+int mclock_virtual_detach(void);
+
+/* Hold n places for threads about to be started, which attach into them,
+ * so that the time does not move on before they are up. A negative n gives
+ * back places that will not be taken. */
+void mclock_virtual_reserve(int n);
+
+/* Hold the time where it is, whoever is asleep, until ready(opaque) says
+ * the threads working for the participants have caught up with it. Those
+ * block on queues rather than on the clock, so they are not participants
+ * themselves: whatever ready() looks at is reported as it changes with
+ * mclock_virtual_kick(), a no-op on a real clock. NULL removes the gate. */
+void mclock_virtual_gate(int (*ready)(void *opaque), void *opaque);
+void mclock_virtual_kick(void);
+
+#endif
@@ -0,0 +1,127 @@
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+
+#include "mixer.h"
+
+void mix_add_s16(int16_t *dst, const int16_t *src, int nb_samples)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 8 <= nb_samples; i += 8) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epi16(d, s));
+    }
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; i + 8 <= nb_samples; i += 8)
+        vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), vld1q_s16(src + i)));
+#endif
+    for (; i < nb_samples; i++)
+        dst[i] = av_clip_int16(dst[i] + src[i]);
+}
+
+void mix_fade_s16(int16_t *dst, const int16_t *src, int nb_samples,
+        int dst_gain, int src_gain)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    {
+        /* interleave dst and src so that one madd does both products;
+           2 * 32767 * 32767 still fits the 32 bit sums */
+        __m128i g = _mm_set1_epi32((src_gain << 16) | (dst_gain & 0xffff));
+
+        for (; i + 8 <= nb_samples; i += 8) {
+            __m128i d  = _mm_loadu_si128((const __m128i *)(dst + i));
+            __m128i s  = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i lo = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(d, s), g), 15);
+            __m128i hi = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(d, s), g), 15);
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+        }
+    }
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    {
+        int16x4_t dg = vdup_n_s16(dst_gain);
+        int16x4_t sg = vdup_n_s16(src_gain);
+
+        for (; i + 8 <= nb_samples; i += 8) {
+            int16x8_t d  = vld1q_s16(dst + i);
+            int16x8_t s  = vld1q_s16(src + i);
+            int32x4_t lo = vmlal_s16(vmull_s16(vget_low_s16(d), dg), vget_low_s16(s), sg);
+            int32x4_t hi = vmlal_s16(vmull_s16(vget_high_s16(d), dg), vget_high_s16(s), sg);
+            vst1q_s16(dst + i, vcombine_s16(vqshrn_n_s32(lo, 15), vqshrn_n_s32(hi, 15)));
+        }
+    }
+#endif
+    for (; i < nb_samples; i++)
+        dst[i] = av_clip_int16((dst[i] * dst_gain + src[i] * src_gain) >> 15);
+}
+
+int pcm_ring_init(PCMRing *ring, unsigned size)
+{
+    memset(ring, 0, sizeof(*ring));
+    if (size & (size - 1))
+        return AVERROR(EINVAL);
+    if (!(ring->data = av_malloc(size)))
+        return AVERROR(ENOMEM);
+    ring->size = size;
+    return 0;
+}
+
+void pcm_ring_free(PCMRing *ring)
+{
+    av_freep(&ring->data);
+    ring->size = 0;
+}
+
+unsigned pcm_ring_fill(const PCMRing *ring)
+{
+    return ring->windex - ring->rindex;
+}
+
+int pcm_ring_write(PCMRing *ring, const uint8_t *buf, int len)
+{
+    unsigned windex = ring->windex;
+    unsigned pos = windex & (ring->size - 1);
+    int n;
+
+    len = FFMIN(len, ring->size - (windex - ring->rindex));
+    n = FFMIN(len, ring->size - pos);
+    memcpy(ring->data + pos, buf, n);
+    memcpy(ring->data, buf + n, len - n);
+    /* the data must be in place before the reader can see it */
+    __sync_synchronize();
+    ring->windex = windex + len;
+    return len;
+}
+
+int pcm_ring_read(PCMRing *ring, uint8_t *buf, int len)
+{
+    unsigned rindex = ring->rindex;
+    unsigned pos = rindex & (ring->size - 1);
+    int n;
+
+    len = FFMIN(len, ring->windex - rindex);
+    __sync_synchronize();
+    n = FFMIN(len, ring->size - pos);
+    memcpy(buf, ring->data + pos, n);
+    memcpy(buf + n, ring->data, len - n);
+    /* and copied out before the writer may reuse it */
+    __sync_synchronize();
+    ring->rindex = rindex + len;
+    return len;
+}
+
+void pcm_ring_drop(PCMRing *ring)
+{
+    ring->rindex = ring->windex;
+}
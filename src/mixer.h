@@ -0,0 +1,43 @@
+#ifndef MIXER_H
+#define MIXER_H
+
+#include <stdint.h>
+
+/* Mixing of interleaved signed 16 bit PCM, in the format the audio callback
+ * hands to the device. Sums saturate instead of wrapping. Counts are in
+ * samples, all channels included. None of these allocate, so they are safe
+ * to call from the audio callback. */
+
+/* dst += src */
+void mix_add_s16(int16_t *dst, const int16_t *src, int nb_samples);
+
+/* dst = dst * dst_gain + src * src_gain, gains in Q15 (32767 is unity) */
+void mix_fade_s16(int16_t *dst, const int16_t *src, int nb_samples,
+        int dst_gain, int src_gain);
+
+/* Byte ring for one producer and one consumer thread. The indices run
+ * freely and each is only written by its own side, so neither side has to
+ * take a lock. The size is a power of two. */
+typedef struct PCMRing {
+    uint8_t *data;
+    unsigned size;
+    volatile unsigned rindex;
+    volatile unsigned windex;
+} PCMRing;
+
+int pcm_ring_init(PCMRing *ring, unsigned size);
+void pcm_ring_free(PCMRing *ring);
+
+/* bytes waiting to be read */
+unsigned pcm_ring_fill(const PCMRing *ring);
+
+/* producer side: copy in up to len bytes, returns how many fitted */
+int pcm_ring_write(PCMRing *ring, const uint8_t *buf, int len);
+
+/* consumer side: copy out up to len bytes, returns how many there were */
+int pcm_ring_read(PCMRing *ring, uint8_t *buf, int len);
+
+/* consumer side: discard everything written so far */
+void pcm_ring_drop(PCMRing *ring);
+
+#endif
@@ -0,0 +1,207 @@
+#include <libavutil/mem.h>
+#include <libavformat/avio.h>
+
+#include "packmap.h"
+
+#define PACK_START_CODE         0xba
+#define SYSTEM_HEADER_START     0xbb
+#define PROGRAM_END_CODE        0xb9
+#define PRIVATE_STREAM_1        0xbd
+
+static int is_pes_stream(int code)
+{
+    return code == PRIVATE_STREAM_1 || (code >= 0xc0 && code <= 0xef);
+}
+
+/* return the next start code and its offset, -1 at the end of the file */
+static int next_start_code(AVIOContext *pb, int64_t *pos)
+{
+    uint32_t state = 0xffffffff;
+
+    while (!url_feof(pb)) {
+        state = (state << 8) | avio_r8(pb);
+        if ((state & 0xffffff00) == 0x100) {
+            *pos = avio_tell(pb) - 4;
+            return state & 0xff;
+        }
+    }
+    return -1;
+}
+
+/* The first payload byte of a private stream 1 PES, which the mpeg demuxer
+   uses as the stream id of the substream. *len is what is left of the PES
+   and is reduced by what has been read. Returns -1 if the header is cut. */
+static int private_substream_id(AVIOContext *pb, int *len)
+{
+    int c, skip;
+
+    if (*len < 1)
+        return -1;
+    c = avio_r8(pb);
+    (*len)--;
+    if ((c & 0xc0) == 0x80) {
+        /* MPEG-2: flags, then the length of the optional fields */
+        if (*len < 2)
+            return -1;
+        avio_r8(pb);
+        skip = avio_r8(pb);
+        *len -= 2;
+    } else {
+        /* MPEG-1: stuffing, buffer size and timestamps */
+        while (c == 0xff && *len > 0) {
+            c = avio_r8(pb);
+            (*len)--;
+        }
+        if ((c & 0xc0) == 0x40) {
+            if (*len < 2)
+                return -1;
+            avio_r8(pb);
+            c = avio_r8(pb);
+            *len -= 2;
+        }
+        skip = (c & 0xf0) == 0x20 ? 4 : (c & 0xf0) == 0x30 ? 9 : 0;
+    }
+    if (*len <= skip)
+        return -1;
+    avio_skip(pb, skip);
+    *len -= skip + 1;
+    return avio_r8(pb);
+}
+
+static int add_run(PackMap *map, int stream_id, int64_t pos, int64_t end)
+{
+    PackRun *run;
+
+    if (map->nb_runs) {
+        run = &map->runs[map->nb_runs - 1];
+        if (run->stream_id == stream_id && run->end >= pos) {
+            run->end = end;
+            return 0;
+        }
+    }
+    if (map->nb_runs >= map->runs_allocated) {
+        int size = FFMAX(1024, 2 * map->runs_allocated);
+        PackRun *runs = av_realloc(map->runs, size * sizeof(*runs));
+        if (!runs)
+            return AVERROR(ENOMEM);
+        map->runs = runs;
+        map->runs_allocated = size;
+    }
+    run = &map->runs[map->nb_runs++];
+    run->pos = pos;
+    run->end = end;
+    run->stream_id = stream_id;
+    run->stream_index = -1;
+    return 0;
+}
+
+int packmap_build(PackMap *map, const char *filename,
+        const volatile int *abort_request)
+{
+    AVIOContext *pb = NULL;
+    int64_t pos, end;
+    int code, c, len, id, ret;
+
+    memset(map, 0, sizeof(*map));
+    if ((ret = avio_open(&pb, filename, AVIO_FLAG_READ)) < 0)
+        return ret;
+    map->file_size = avio_size(pb);
+
+    while ((code = next_start_code(pb, &pos)) >= 0) {
+        if (*abort_request) {
+            ret = AVERROR_EXIT;
+            goto fail;
+        }
+        if (code == PACK_START_CODE) {
+            c = avio_r8(pb);
+            if ((c & 0xc0) == 0x40) {
+                /* MPEG-2 pack header, followed by stuffing */
+                avio_skip(pb, 8);
+                avio_skip(pb, avio_r8(pb) & 7);
+            } else {
+                avio_skip(pb, 7);
+            }
+        } else if (code >= SYSTEM_HEADER_START) {
+            len = avio_rb16(pb);
+            end = avio_tell(pb) + len;
+            if (is_pes_stream(code)) {
+                /* ids as the mpeg demuxer assigns them to AVStream.id */
+                id = 0x100 | code;
+                if (code == PRIVATE_STREAM_1 && (id = private_substream_id(pb, &len)) < 0)
+                    id = 0x100 | code;
+                if ((ret = add_run(map, id, pos, end)) < 0)
+                    goto fail;
+            }
+            avio_skip(pb, len);
+        }
+        /* anything else (program end, stray video start codes) is
+           resynchronised on by next_start_code() */
+    }
+    if (map->file_size <= 0)
+        map->file_size = avio_tell(pb);
+    avio_close(pb);
+    return 0;
+fail:
+    avio_close(pb);
+    packmap_free(map);
+    return ret;
+}
+
+void packmap_resolve(PackMap *map, const int *ids, int nb_streams)
+{
+    int i, j;
+
+    for (i = 0; i < map->nb_runs; i++) {
+        map->runs[i].stream_index = -1;
+        for (j = 0; j < nb_streams; j++) {
+            if (ids[j] == map->runs[i].stream_id) {
+                map->runs[i].stream_index = j;
+                break;
+            }
+        }
+    }
+}
+
+static int run_is_active(const PackRun *run, uint64_t active_mask)
+{
+    if (run->stream_index < 0 || run->stream_index >= 64)
+        return 1;
+    return !!(active_mask & (UINT64_C(1) << run->stream_index));
+}
+
+int64_t packmap_next(const PackMap *map, int64_t pos, uint64_t active_mask)
+{
+    int lo = 0, hi = map->nb_runs;
+
+    /* first run ending after pos */
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (map->runs[mid].end <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < map->nb_runs; lo++) {
+        const PackRun *run = &map->runs[lo];
+        if (run_is_active(run, active_mask))
+            return FFMAX(pos, run->pos);
+    }
+    return FFMAX(pos, map->file_size);
+}
+
+int64_t packmap_stream_end(const PackMap *map, int stream_index)
+{
+    int i;
+
+    for (i = map->nb_runs - 1; i >= 0; i--)
+        if (map->runs[i].stream_index == stream_index)
+            return map->runs[i].end;
+    return -1;
+}
+
+void packmap_free(PackMap *map)
+{
+    av_freep(&map->runs);
+    map->nb_runs = 0;
+    map->runs_allocated = 0;
+}
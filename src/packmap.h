@@ -0,0 +1,48 @@
+#ifndef PACKMAP_H
+#define PACKMAP_H
+
+#include <stdint.h>
+
+/* Byte-range map of an MPEG program stream.
+ *
+ * Consecutive PES packets carrying the same stream are merged into one run,
+ * so the reader can jump straight over runs belonging to streams that are
+ * not currently being played instead of pulling them through the demuxer. */
+
+typedef struct PackRun {
+    int64_t pos;        /* offset of the first PES start code of the run */
+    int64_t end;        /* offset just past the last PES of the run */
+    int stream_id;      /* AVStream.id the mpeg demuxer gives the payload: the
+                           start code (0x1c0, 0x1e0, ...), or for private
+                           stream 1 the substream number (0x80 for AC-3, ...) */
+    int stream_index;   /* matching AVStream, -1 if unknown (never skipped) */
+} PackRun;
+
+typedef struct PackMap {
+    PackRun *runs;
+    int nb_runs;
+    int runs_allocated;
+    int64_t file_size;
+} PackMap;
+
+/* Scan the pack and PES headers of filename. Payloads are skipped, so the
+ * cost is one sequential pass over the file. Returns < 0 on error or if
+ * *abort_request became set during the scan. */
+int packmap_build(PackMap *map, const char *filename,
+        const volatile int *abort_request);
+
+/* Resolve the stream ids to stream indices, ids[i] being AVStream.id of
+ * stream i as set by the mpeg demuxer. */
+void packmap_resolve(PackMap *map, const int *ids, int nb_streams);
+
+/* Offset of the first run at or after pos holding one of the streams in
+ * active_mask, pos itself if pos lies inside such a run, or the file size
+ * if no further run is of interest. */
+int64_t packmap_next(const PackMap *map, int64_t pos, uint64_t active_mask);
+
+/* Offset just past the last PES of stream_index, -1 if it is not mapped */
+int64_t packmap_stream_end(const PackMap *map, int stream_index);
+
+void packmap_free(PackMap *map);
+
+#endif
@@ -0,0 +1,104 @@
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+
+#include "pktarena.h"
+
+#define SLAB_ALIGN 16
+
+void pkt_arena_init(PacketArena *a, int slab_size)
+{
+    memset(a, 0, sizeof(*a));
+    a->slab_size = slab_size;
+}
+
+/* back to the free list, or to the heap if of an odd size */
+static void arena_recycle(PacketArena *a, PacketSlab *s)
+{
+    if (s->size == a->slab_size) {
+        s->next = a->free;
+        a->free = s;
+    } else {
+        av_free(s);
+    }
+}
+
+static PacketSlab *arena_new_slab(PacketArena *a, int size)
+{
+    PacketSlab *s;
+    int header = FFALIGN(sizeof(PacketSlab), SLAB_ALIGN);
+
+    if (size <= a->slab_size) {
+        if ((s = a->free)) {
+            a->free = s->next;
+            goto done;
+        }
+        size = a->slab_size;
+    }
+    if (!(s = av_malloc(header + size)))
+        return NULL;
+    s->data = (uint8_t *)s + header;
+    s->size = size;
+done:
+    s->next = NULL;
+    s->used = 0;
+    return s;
+}
+
+void *pkt_arena_alloc(PacketArena *a, int size, PacketSlab **slab)
+{
+    PacketSlab *s = a->last;
+    void *ptr;
+
+    size = FFALIGN(size, SLAB_ALIGN);
+    if (!s || s->used + size > s->size) {
+        if (!(s = arena_new_slab(a, size)))
+            return NULL;
+        if (a->last)
+            a->last->next = s;
+        else
+            a->queued = s;
+        a->last = s;
+    }
+    ptr = s->data + s->used;
+    s->used += size;
+    *slab = s;
+    return ptr;
+}
+
+void pkt_arena_release(PacketArena *a, PacketSlab *head)
+{
+    PacketSlab *s;
+
+    while (a->queued && a->queued != head) {
+        s = a->queued;
+        a->queued = s->next;
+        arena_recycle(a, s);
+    }
+    if (!a->queued)
+        a->last = NULL;
+}
+
+PacketSlab *pkt_arena_detach(PacketArena *a)
+{
+    PacketSlab *s = a->queued;
+
+    a->queued = a->last = NULL;
+    return s;
+}
+
+void pkt_arena_free_slabs(PacketSlab *s)
+{
+    PacketSlab *next;
+
+    for (; s; s = next) {
+        next = s->next;
+        av_free(s);
+    }
+}
+
+void pkt_arena_free(PacketArena *a)
+{
+    pkt_arena_free_slabs(a->queued);
+    pkt_arena_free_slabs(a->free);
+    a->queued = a->last = a->free = NULL;
+}
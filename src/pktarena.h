@@ -0,0 +1,49 @@
+#ifndef PKTARENA_H
+#define PKTARENA_H
+
+#include <stdint.h>
+
+/* Slab allocator for the list nodes of one packet queue.
+ *
+ * Only the nodes: payloads stay the demuxer's heap allocations, adopted as
+ * they are and freed by whoever ends up with the packet. A node is carved
+ * out of the slab being filled and is only needed while its packet is
+ * queued, the packet being copied out of it when taken. The slabs the
+ * queue has moved past are therefore reused straight away, so steady
+ * playback queues packets without allocating a node, and a flush detaches
+ * all of the queue's slabs at once.
+ *
+ * Everything runs under the queue's lock. */
+
+typedef struct PacketSlab {
+    struct PacketSlab *next;
+    uint8_t *data;
+    int size;
+    int used;
+} PacketSlab;
+
+typedef struct PacketArena {
+    PacketSlab *queued;         /* slabs the queue owns, oldest first */
+    PacketSlab *last;           /* the one being filled, end of queued */
+    PacketSlab *free;
+    int slab_size;
+} PacketArena;
+
+void pkt_arena_init(PacketArena *a, int slab_size);
+
+/* size bytes, 16 byte aligned, from the slab being filled or a new one.
+ * Requests larger than a slab get a slab of their own. */
+void *pkt_arena_alloc(PacketArena *a, int size, PacketSlab **slab);
+
+/* the queue no longer holds anything before head, the slab of its oldest
+ * packet (or the one being filled if it is empty) */
+void pkt_arena_release(PacketArena *a, PacketSlab *head);
+
+/* The queue has been emptied, but its nodes are still to be gone through:
+ * hand the slabs they are in over, for pkt_arena_free_slabs(). */
+PacketSlab *pkt_arena_detach(PacketArena *a);
+void pkt_arena_free_slabs(PacketSlab *s);
+
+void pkt_arena_free(PacketArena *a);
+
+#endif
@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include <SDL.h>
+#include <SDL_thread.h>
+
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include "prefetch.h"
+
+#define IO_BUFFER_SIZE  32768
+#define READ_THREADS    2
+
+enum { BLOCK_EMPTY, BLOCK_PENDING, BLOCK_READY };
+
+typedef struct Block {
+    int64_t index;      /* of the block in the file, -1 for none */
+    int size;           /* bytes read, short at the end of the file, < 0 on error */
+    int state;
+    uint8_t *data;
+} Block;
+
+typedef struct Prefetch {
+    int fd;
+    int64_t file_size;
+    int64_t nb_file_blocks;
+    int64_t pos;        /* of the reader */
+    int block_size;
+    int nb_blocks;
+    Block *blocks;      /* block i lives in blocks[i % nb_blocks] */
+    int64_t want;       /* first block of the window */
+    SDL_mutex *mutex;
+    SDL_cond *ready;    /* a block has been read */
+    SDL_cond *work;     /* the window has moved, or a slot came free */
+    SDL_Thread *tid[READ_THREADS];
+    int nb_threads;
+    int abort;
+    int64_t stall_time;
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    int uring;
+    int in_flight;
+#endif
+} Prefetch;
+
+/* a block of the window that nobody has asked for yet, mutex held. Its
+   slot is taken over from whatever it held before, unless that is still
+   being read. */
+static Block *prefetch_claim(Prefetch *p)
+{
+    int64_t i, last = FFMIN(p->want + p->nb_blocks, p->nb_file_blocks);
+    Block *b;
+
+    for (i = FFMAX(p->want, 0); i < last; i++) {
+        b = &p->blocks[i % p->nb_blocks];
+        if (b->index == i || b->state == BLOCK_PENDING)
+            continue;
+        b->index = i;
+        b->size  = 0;
+        b->state = BLOCK_PENDING;
+        return b;
+    }
+    return NULL;
+}
+
+/* mutex held */
+static void prefetch_done(Prefetch *p, Block *b, int size)
+{
+    b->size  = size;
+    b->state = BLOCK_READY;
+    SDL_CondBroadcast(p->ready);
+    SDL_CondSignal(p->work);
+}
+
+static int read_thread(void *arg)
+{
+    Prefetch *p = arg;
+    Block *b;
+    int n;
+
+    prctl(PR_SET_NAME, "prefetch", 0, 0, 0);
+    SDL_LockMutex(p->mutex);
+    while (!p->abort) {
+        if (!(b = prefetch_claim(p))) {
+            SDL_CondWait(p->work, p->mutex);
+            continue;
+        }
+        SDL_UnlockMutex(p->mutex);
+        n = pread(p->fd, b->data, p->block_size, b->index * p->block_size);
+        SDL_LockMutex(p->mutex);
+        prefetch_done(p, b, n < 0 ? AVERROR(errno) : n);
+    }
+    SDL_UnlockMutex(p->mutex);
+    return 0;
+}
+
+#ifdef HAVE_LIBURING
+/* one thread keeps the whole window submitted and reaps the completions */
+static int uring_thread(void *arg)
+{
+    Prefetch *p = arg;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    Block *b;
+    int queued;
+
+    prctl(PR_SET_NAME, "prefetch", 0, 0, 0);
+    SDL_LockMutex(p->mutex);
+    while (!p->abort || p->in_flight) {
+        for (queued = 0; !p->abort && (b = prefetch_claim(p)); queued++) {
+            if (!(sqe = io_uring_get_sqe(&p->ring))) {
+                b->index = -1;
+                b->state = BLOCK_EMPTY;
+                break;
+            }
+            io_uring_prep_read(sqe, p->fd, b->data, p->block_size, b->index * p->block_size);
+            io_uring_sqe_set_data(sqe, b);
+            p->in_flight++;
+        }
+        if (queued)
+            io_uring_submit(&p->ring);
+        if (!p->in_flight) {
+            SDL_CondWait(p->work, p->mutex);
+            continue;
+        }
+        SDL_UnlockMutex(p->mutex);
+        if (io_uring_wait_cqe(&p->ring, &cqe) < 0) {
+            SDL_LockMutex(p->mutex);
+            continue;
+        }
+        SDL_LockMutex(p->mutex);
+        p->in_flight--;
+        prefetch_done(p, io_uring_cqe_get_data(cqe), cqe->res);
+        io_uring_cqe_seen(&p->ring, cqe);
+    }
+    SDL_UnlockMutex(p->mutex);
+    return 0;
+}
+#endif
+
+/* move the window to start at the block holding pos, mutex held. After a
+   jump the kernel is told to start on the new window straight away. */
+static void prefetch_move(Prefetch *p, int64_t pos, int jump)
+{
+    int64_t want = pos / p->block_size;
+
+    if (want == p->want)
+        return;
+    p->want = want;
+    if (jump)
+        posix_fadvise(p->fd, want * p->block_size,
+                      (int64_t)p->nb_blocks * p->block_size, POSIX_FADV_WILLNEED);
+    SDL_CondBroadcast(p->work);
+}
+
+static int prefetch_read(void *opaque, uint8_t *buf, int size)
+{
+    Prefetch *p = opaque;
+    int64_t index, start = 0;
+    int offset, n;
+    Block *b;
+
+    if (p->pos >= p->file_size)
+        return AVERROR_EOF;
+    index  = p->pos / p->block_size;
+    offset = p->pos % p->block_size;
+    b = &p->blocks[index % p->nb_blocks];
+
+    SDL_LockMutex(p->mutex);
+    prefetch_move(p, p->pos, 0);
+    while (!(b->index == index && b->state == BLOCK_READY)) {
+        if (!start)
+            start = av_gettime();
+        SDL_CondWait(p->ready, p->mutex);
+    }
+    if (start)
+        p->stall_time += av_gettime() - start;
+    if ((n = b->size) < 0) {
+        /* let the next attempt read it again */
+        b->index = -1;
+        b->state = BLOCK_EMPTY;
+        SDL_CondSignal(p->work);
+    } else if ((n = FFMIN(size, b->size - offset)) > 0) {
+        memcpy(buf, b->data + offset, n);
+    }
+    SDL_UnlockMutex(p->mutex);
+
+    if (n <= 0)
+        return n < 0 ? n : AVERROR_EOF;
+    p->pos += n;
+    return n;
+}
+
+static int64_t prefetch_seek(void *opaque, int64_t offset, int whence)
+{
+    Prefetch *p = opaque;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return p->file_size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += p->pos;
+        break;
+    case SEEK_END:
+        offset += p->file_size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (offset < 0)
+        return AVERROR(EINVAL);
+    p->pos = offset;
+    SDL_LockMutex(p->mutex);
+    prefetch_move(p, offset, 1);
+    SDL_UnlockMutex(p->mutex);
+    return offset;
+}
+
+static void prefetch_free(Prefetch *p)
+{
+    int i;
+
+    if (p->mutex) {
+        SDL_LockMutex(p->mutex);
+        p->abort = 1;
+        SDL_CondBroadcast(p->work);
+        SDL_UnlockMutex(p->mutex);
+    }
+    for (i = 0; i < p->nb_threads; i++)
+        SDL_WaitThread(p->tid[i], NULL);
+#ifdef HAVE_LIBURING
+    if (p->uring)
+        io_uring_queue_exit(&p->ring);
+#endif
+    if (p->blocks)
+        for (i = 0; i < p->nb_blocks; i++)
+            av_free(p->blocks[i].data);
+    av_free(p->blocks);
+    SDL_DestroyMutex(p->mutex);
+    SDL_DestroyCond(p->ready);
+    SDL_DestroyCond(p->work);
+    if (p->fd >= 0)
+        close(p->fd);
+    av_free(p);
+}
+
+AVIOContext *prefetch_open(const char *filename, int window, int block_size)
+{
+    Prefetch *p;
+    AVIOContext *pb;
+    uint8_t *buffer = NULL;
+    struct stat st;
+    int i;
+
+    if (!(p = av_mallocz(sizeof(*p))))
+        return NULL;
+    p->fd = open(filename, O_RDONLY);
+    if (p->fd < 0 || fstat(p->fd, &st) < 0 || !S_ISREG(st.st_mode))
+        goto fail;
+    p->file_size      = st.st_size;
+    p->block_size     = block_size;
+    p->nb_file_blocks = (p->file_size + block_size - 1) / block_size;
+    p->nb_blocks      = FFMAX(2, window / block_size);
+    if (!(p->blocks = av_mallocz(p->nb_blocks * sizeof(*p->blocks))))
+        goto fail;
+    for (i = 0; i < p->nb_blocks; i++) {
+        p->blocks[i].index = -1;
+        if (!(p->blocks[i].data = av_malloc(block_size)))
+            goto fail;
+    }
+    p->mutex = SDL_CreateMutex();
+    p->ready = SDL_CreateCond();
+    p->work  = SDL_CreateCond();
+    posix_fadvise(p->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (!(buffer = av_malloc(IO_BUFFER_SIZE)) ||
+        !(pb = avio_alloc_context(buffer, IO_BUFFER_SIZE, 0, p, prefetch_read, NULL, prefetch_seek)))
+        goto fail;
+
+#ifdef HAVE_LIBURING
+    if (io_uring_queue_init(p->nb_blocks, &p->ring, 0) >= 0) {
+        p->uring = 1;
+        p->tid[p->nb_threads++] = SDL_CreateThread(uring_thread, p);
+    }
+#endif
+    if (!p->nb_threads)
+        for (i = 0; i < READ_THREADS; i++)
+            p->tid[p->nb_threads++] = SDL_CreateThread(read_thread, p);
+    return pb;
+fail:
+    av_free(buffer);
+    prefetch_free(p);
+    return NULL;
+}
+
+int64_t prefetch_stall_time(AVIOContext *pb)
+{
+    Prefetch *p = pb->opaque;
+
+    return p->stall_time;
+}
+
+void prefetch_close(AVIOContext **pb)
+{
+    if (!*pb)
+        return;
+    prefetch_free((*pb)->opaque);
+    av_freep(&(*pb)->buffer);
+    av_freep(pb);
+}
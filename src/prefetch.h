@@ -0,0 +1,24 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdint.h>
+#include <libavformat/avio.h>
+
+/* Read-ahead for local files, so that a slow storage read does not hold up
+ * the demuxer. A window of block sized, block aligned reads is kept in
+ * flight ahead of the read position, through io_uring when built with
+ * HAVE_LIBURING and from a couple of pread() threads otherwise. A seek
+ * moves the window straight to the target. */
+
+/* Open filename for reading with window bytes of read-ahead in blocks of
+ * block_size. The result goes in AVFormatContext.pb, with
+ * AVFMT_FLAG_CUSTOM_IO. Returns NULL if the file cannot be read this way,
+ * not being a regular file for instance. */
+AVIOContext *prefetch_open(const char *filename, int window, int block_size);
+
+/* microseconds the reader has spent waiting for data that was not there yet */
+int64_t prefetch_stall_time(AVIOContext *pb);
+
+void prefetch_close(AVIOContext **pb);
+
+#endif
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "mclock.h"
+#include "present.h"
+
+/* a present is issued this long before the refresh it is meant for */
+#define PRESENT_MARGIN 0.002
+/* a present taking longer than this may have waited for the vertical blank */
+#define PRESENT_BLOCKED 0.001
+/* blocking presents in a row away from the predicted refreshes before the
+   phase is taken again from scratch */
+#define PRESENT_MAX_MISSES 8
+
+static double fb_mode_rate(void)
+{
+    FILE *f = fopen("/sys/class/graphics/fb0/modes", "r");
+    char mode[64];
+    double hz = 0;
+    char *p;
+
+    if (!f)
+        return 0;
+    /* "U:1920x1080p-60" */
+    if (fgets(mode, sizeof(mode), f) && (p = strrchr(mode, '-')))
+        hz = atof(p + 1);
+    fclose(f);
+    return hz;
+}
+
+void present_init(PresentClock *pc, double hz)
+{
+    if (hz <= 0)
+        hz = fb_mode_rate();
+    if (hz < 20 || hz > 250)
+        hz = 60;
+    pc->period = 1.0 / hz;
+    pc->phase = mclock_now();
+    pc->last_vsync = 0;
+    pc->vsync = 0;
+    pc->misses = 0;
+}
+
+/* first refresh at or after t */
+static double next_vsync(const PresentClock *pc, double t)
+{
+    return pc->phase + ceil((t - pc->phase) / pc->period) * pc->period;
+}
+
+double present_lead(const PresentClock *pc)
+{
+    double now = mclock_now();
+
+    return next_vsync(pc, now + PRESENT_MARGIN) - now + pc->period / 2;
+}
+
+double present_wakeup(const PresentClock *pc, double t)
+{
+    return next_vsync(pc, t - pc->period / 2) - PRESENT_MARGIN;
+}
+
+void present_done(PresentClock *pc, double start, double end)
+{
+    double interval = end - pc->last_vsync;
+    double n;
+
+    /* a slow blit takes as long without waiting for anything */
+    if (!pc->vsync || end - start < PRESENT_BLOCKED)
+        return;
+    /* nor is a present that ends away from any refresh taken for one, until
+       enough of them say the phase itself is off */
+    if (pc->last_vsync &&
+        fabs(end - next_vsync(pc, end - pc->period / 2)) >= pc->period / 4 &&
+        ++pc->misses < PRESENT_MAX_MISSES)
+        return;
+    if (pc->misses >= PRESENT_MAX_MISSES)
+        interval = 0;
+    pc->misses = 0;
+    /* the present returned at a refresh: lock the phase to it, and pull
+       the period towards the interval from the previous one when that is
+       close to a whole number of periods */
+    n = floor(interval / pc->period + 0.5);
+    if (pc->last_vsync && n >= 1 && n <= 8 &&
+        fabs(interval - n * pc->period) < pc->period / 4)
+        pc->period += 0.05 * (interval / n - pc->period);
+    pc->phase = end;
+    pc->last_vsync = end;
+}
@@ -0,0 +1,34 @@
+#ifndef PRESENT_H
+#define PRESENT_H
+
+/* Presentation timing. The refresh period of the display is taken from the
+ * framebuffer mode and, when the video mode is known to make presents block
+ * until the vertical blank, refined from those presents, which also give
+ * the phase of the refresh. Pictures are then
+ * presented just ahead of the refresh nearest their due time, and the
+ * display loop sleeps to that absolute time instead of polling. Times are
+ * mclock_now() seconds. */
+
+typedef struct PresentClock {
+    double period;          /* estimated refresh period */
+    double phase;           /* time of some refresh */
+    double last_vsync;      /* end of the last present that waited for one */
+    int vsync;              /* presents block until the vertical blank */
+    int misses;             /* blocking presents in a row away from any refresh */
+} PresentClock;
+
+/* hz of 0 reads the rate of the framebuffer mode, 60 if there is none */
+void present_init(PresentClock *pc, double hz);
+
+/* Time between presenting a picture now and its due time being best
+ * served, that is the wait for the next refresh plus half a period. A
+ * picture due before now plus this should go out now. */
+double present_lead(const PresentClock *pc);
+
+/* when to present a picture due at t */
+double present_wakeup(const PresentClock *pc, double t);
+
+/* a present ran from start to end */
+void present_done(PresentClock *pc, double start, double end);
+
+#endif